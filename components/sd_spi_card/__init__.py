@@ -1,26 +1,168 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
-from esphome import pins
-from esphome.const import CONF_ID
+from esphome import automation, pins
+import esphome.final_validate as fv
+from esphome.components import spi, web_server_base
+from esphome.components.esp32 import get_esp32_variant
+from esphome.components.esp32.const import (
+    VARIANT_ESP32,
+    VARIANT_ESP32P4,
+    VARIANT_ESP32S2,
+    VARIANT_ESP32S3,
+)
+from esphome.components.web_server_base import CONF_WEB_SERVER_BASE_ID
+from esphome.const import CONF_ID, CONF_NUMBER, CONF_SPI_ID, CONF_TYPE, CONF_VALUE
+from esphome.core import CORE, Lambda
 
 sd_spi_card_ns = cg.esphome_ns.namespace("sd_spi_card")
 ##SdSpiCard = sd_spi_card_ns.class_("SdSpiCard", cg.Component)
 SdSpiCard = sd_spi_card_ns.class_("SdSpiCard", cg.PollingComponent, cg.Component)
+CsvAppendAction = sd_spi_card_ns.class_("CsvAppendAction", automation.Action)
+SdSpiCardHttpExport = sd_spi_card_ns.class_("SdSpiCardHttpExport", cg.Component)
+
+MULTI_CONF = True
 
 CONF_SD_SPI_CARD_ID = "sd_spi_card_id"
 CONF_PATH = "path"
 
 
 CONF_SPI_FREQ = "spi_freq"
+CONF_SPI_HOST = "spi_host"
+CONF_MOUNT_POINT = "mount_point"
+CONF_BURST_SIZE = "burst_size"
+CONF_HTTP_EXPORT = "http_export"
+CONF_SPILL_QUEUE = "spill_queue"
+CONF_READ_AHEAD = "read_ahead"
+CONF_RECOVERY = "recovery"
+CONF_CHECKSUMS = "checksums"
+CONF_TAIL_WINDOW = "tail_window"
+CONF_FILES = "files"
+CONF_BUFFERS = "buffers"
+CONF_BUFFER_SIZE = "buffer_size"
+CONF_MAX_SIZE = "max_size"
+CONF_PERSIST = "persist"
+CONF_PERSIST_SLOTS = "persist_slots"
+
+# buffers: 1 turns read-ahead off; 2 is ping-pong
+READ_AHEAD_SCHEMA = cv.Schema({
+    cv.Optional(CONF_BUFFERS, default=2): cv.int_range(min=1, max=8),
+    cv.Optional(CONF_BUFFER_SIZE, default="4KB"): cv.All(
+        cv.validate_bytes, cv.int_range(min=512, max=32768)
+    ),
+})
+
+# Mount-time recovery: journaled .tmp rewrites plus tail checks of these files
+RECOVERY_SCHEMA = cv.Schema({
+    cv.Optional(CONF_CHECKSUMS, default=False): cv.boolean,
+    cv.Optional(CONF_TAIL_WINDOW, default="4KB"): cv.All(
+        cv.validate_bytes, cv.int_range(min=256, max=65536)
+    ),
+    cv.Optional(CONF_FILES, default=[]): cv.ensure_list(cv.string_strict),
+})
+
+SPILL_QUEUE_SCHEMA = cv.Schema({
+    cv.Optional(CONF_MAX_SIZE, default="8KB"): cv.All(cv.validate_bytes, cv.int_range(min=512)),
+    cv.Optional(CONF_PERSIST, default=False): cv.boolean,
+    cv.Optional(CONF_PERSIST_SLOTS, default=32): cv.int_range(min=4, max=256),
+})
+CONF_URL_PREFIX = "url_prefix"
+
+HTTP_EXPORT_SCHEMA = cv.Schema({
+    cv.GenerateID(): cv.declare_id(SdSpiCardHttpExport),
+    cv.GenerateID(CONF_WEB_SERVER_BASE_ID): cv.use_id(web_server_base.WebServerBase),
+    cv.Optional(CONF_URL_PREFIX, default="/sd"): cv.All(cv.string_strict, cv.Length(min=2)),
+})
+
+SPI_HOSTS = {
+    "spi2": "SPI2_HOST",
+    "spi3": "SPI3_HOST",
+    "hspi": "SPI2_HOST",
+    "vspi": "SPI3_HOST",
+}
+BUS_PINS = ["clk_pin", "mosi_pin", "miso_pin"]
+# Variants with a general purpose SPI3; the rest (C3, C6, H2, ...) stop at SPI2
+SPI3_VARIANTS = [VARIANT_ESP32, VARIANT_ESP32S2, VARIANT_ESP32S3, VARIANT_ESP32P4]
+
+
+def spi_host_of(config):
+    if CONF_SPI_HOST in config:
+        return SPI_HOSTS[config[CONF_SPI_HOST]]
+    return "SPI3_HOST" if get_esp32_variant() in SPI3_VARIANTS else "SPI2_HOST"
 
-CONFIG_SCHEMA = cv.Schema({
+
+def validate_bus(config):
+    # Either we bring up the bus ourselves or we ride on an ESPHome spi: bus
+    if CONF_SPI_ID in config:
+        for pin in BUS_PINS:
+            if pin in config:
+                raise cv.Invalid(f"{pin} comes from the spi: bus when spi_id is set")
+    else:
+        for pin in BUS_PINS:
+            if pin not in config:
+                raise cv.Invalid(f"{pin} is required unless spi_id is set")
+    return config
+
+
+CONFIG_SCHEMA = cv.All(cv.Schema({
     cv.GenerateID(): cv.declare_id(SdSpiCard),
     cv.Required("cs_pin"): pins.gpio_output_pin_schema,
-    cv.Required("clk_pin"): pins.gpio_output_pin_schema,
-    cv.Required("mosi_pin"): pins.gpio_output_pin_schema,
-    cv.Required("miso_pin"): pins.gpio_output_pin_schema,
+    cv.Optional("clk_pin"): pins.gpio_output_pin_schema,
+    cv.Optional("mosi_pin"): pins.gpio_output_pin_schema,
+    cv.Optional("miso_pin"): pins.gpio_output_pin_schema,
+    cv.Optional(CONF_SPI_ID): cv.use_id(spi.SPIComponent),
+    cv.Optional(CONF_SPI_HOST): cv.one_of(*SPI_HOSTS, lower=True),
+    cv.Optional(CONF_MOUNT_POINT, default="/sdcard"): cv.All(
+        cv.string_strict, cv.Length(min=2), cv.Length(max=15)
+    ),
+    cv.Optional(CONF_BURST_SIZE, default="16KB"): cv.All(
+        cv.validate_bytes, cv.int_range(min=512)
+    ),
     cv.Optional(CONF_SPI_FREQ, default=1000): cv.int_range(min=100, max=40000),
-}).extend(cv.polling_component_schema("60s"))
+    cv.Optional(CONF_HTTP_EXPORT): HTTP_EXPORT_SCHEMA,
+    cv.Optional(CONF_SPILL_QUEUE): SPILL_QUEUE_SCHEMA,
+    cv.Optional(CONF_READ_AHEAD, default={}): READ_AHEAD_SCHEMA,
+    cv.Optional(CONF_RECOVERY, default={}): RECOVERY_SCHEMA,
+}).extend(cv.polling_component_schema("60s")), validate_bus)
+
+
+def shared_bus_host(full_config, config):
+    # Host of the spi: bus we share; it must be pinned to a hardware interface
+    for bus in full_config.get("spi", []):
+        if bus[CONF_ID] == config[CONF_SPI_ID]:
+            interface = str(bus.get("interface", "any")).lower()
+            if interface not in ("spi2", "spi3"):
+                raise cv.Invalid(
+                    "spi: bus shared with sd_spi_card needs 'interface: spi2' or 'interface: spi3'"
+                )
+            return interface
+    raise cv.Invalid(f"spi: bus {config[CONF_SPI_ID]} not found")
+
+
+def final_validate(config):
+    if CONF_SPI_ID in config:
+        host = shared_bus_host(fv.full_config.get(), config)
+        if CONF_SPI_HOST in config and SPI_HOSTS[config[CONF_SPI_HOST]] != SPI_HOSTS[host]:
+            raise cv.Invalid(f"spi_host does not match the interface of {config[CONF_SPI_ID]}")
+    elif spi_host_of(config) == "SPI3_HOST" and get_esp32_variant() not in SPI3_VARIANTS:
+        raise cv.Invalid(f"{get_esp32_variant()} has no SPI3, use spi_host: spi2")
+    cards = fv.full_config.get()["sd_spi_card"]
+    if CONF_SPI_ID not in config:
+        # The first card initializes the host; later ones just attach to it
+        for other in cards:
+            if CONF_SPI_ID in other or spi_host_of(other) != spi_host_of(config):
+                continue
+            for pin in BUS_PINS:
+                if other[pin][CONF_NUMBER] != config[pin][CONF_NUMBER]:
+                    raise cv.Invalid(
+                        f"cards on {spi_host_of(config)} without spi_id must use the same {pin}"
+                    )
+    mount_points = [c[CONF_MOUNT_POINT] for c in cards]
+    if mount_points.count(config[CONF_MOUNT_POINT]) > 1:
+        raise cv.Invalid(f"mount_point {config[CONF_MOUNT_POINT]} is used by more than one card")
+    return config
+
+
+FINAL_VALIDATE_SCHEMA = final_validate
 
 
 async def to_code(config):
@@ -28,13 +170,109 @@ async def to_code(config):
     await cg.register_component(var, config)
 
     cs = await cg.gpio_pin_expression(config["cs_pin"])
-    clk = await cg.gpio_pin_expression(config["clk_pin"])
-    mosi = await cg.gpio_pin_expression(config["mosi_pin"])
-    miso = await cg.gpio_pin_expression(config["miso_pin"])
-
     cg.add(var.set_cs_pin(cs))
-    cg.add(var.set_clk_pin(clk))
-    cg.add(var.set_mosi_pin(mosi))
-    cg.add(var.set_miso_pin(miso))
 
+    if CONF_SPI_ID in config:
+        # The spi: component sets up the bus before us (bus priority)
+        host = SPI_HOSTS[shared_bus_host(CORE.config, config)]
+    else:
+        clk = await cg.gpio_pin_expression(config["clk_pin"])
+        mosi = await cg.gpio_pin_expression(config["mosi_pin"])
+        miso = await cg.gpio_pin_expression(config["miso_pin"])
+        cg.add(var.set_clk_pin(clk))
+        cg.add(var.set_mosi_pin(mosi))
+        cg.add(var.set_miso_pin(miso))
+        host = spi_host_of(config)
+
+    cg.add(var.set_spi_host(cg.RawExpression(host)))
+    cg.add(var.set_mount_point(config[CONF_MOUNT_POINT]))
+    cg.add(var.set_burst_size(config[CONF_BURST_SIZE]))
     cg.add(var.set_spi_freq(config[CONF_SPI_FREQ]))
+    cg.add(var.set_read_ahead(
+        config[CONF_READ_AHEAD][CONF_BUFFERS], config[CONF_READ_AHEAD][CONF_BUFFER_SIZE]
+    ))
+
+    recovery = config[CONF_RECOVERY]
+    cg.add(var.set_checksums(recovery[CONF_CHECKSUMS]))
+    cg.add(var.set_recovery_tail_window(recovery[CONF_TAIL_WINDOW]))
+    for path in recovery[CONF_FILES]:
+        cg.add(var.add_recovery_file(path))
+
+    if CONF_SPILL_QUEUE in config:
+        conf = config[CONF_SPILL_QUEUE]
+        slots = conf[CONF_PERSIST_SLOTS] if conf[CONF_PERSIST] else 0
+        cg.add(var.set_spill_queue(conf[CONF_MAX_SIZE], slots))
+
+    if CONF_HTTP_EXPORT in config:
+        conf = config[CONF_HTTP_EXPORT]
+        base = await cg.get_variable(conf[CONF_WEB_SERVER_BASE_ID])
+        cg.add_define("USE_SD_SPI_CARD_HTTP_EXPORT")
+        # Own component so the handler registers after WiFi, not at bus priority
+        export = cg.new_Pvariable(conf[CONF_ID])
+        await cg.register_component(export, conf)
+        await cg.register_parented(export, var)
+        cg.add(export.set_web_server_base(base))
+        cg.add(export.set_url_prefix(conf[CONF_URL_PREFIX].rstrip("/")))
+
+
+CONF_VALUES = "values"
+CONF_DECIMALS = "decimals"
+
+
+def csv_text(value):
+    # The row readers split on ',' and lines, and do not understand quoting
+    value = cv.string(value)
+    if any(c in value for c in ",\r\n"):
+        raise cv.Invalid("CSV text cells cannot contain ',' or line breaks")
+    return value
+
+
+CSV_VALUE_SCHEMA = cv.typed_schema(
+    {
+        "int": cv.Schema({cv.Required(CONF_VALUE): cv.templatable(cv.int_)}),
+        "float": cv.Schema({
+            cv.Required(CONF_VALUE): cv.templatable(cv.float_),
+            cv.Optional(CONF_DECIMALS, default=2): cv.int_range(min=0, max=6),
+        }),
+        # Without a value the row gets the current time
+        "timestamp": cv.Schema({cv.Optional(CONF_VALUE): cv.templatable(cv.int_)}),
+        "string": cv.Schema({cv.Required(CONF_VALUE): cv.templatable(csv_text)}),
+    },
+    lower=True,
+)
+
+CSV_APPEND_ACTION_SCHEMA = cv.Schema({
+    cv.GenerateID(): cv.use_id(SdSpiCard),
+    cv.Required(CONF_PATH): cv.templatable(cv.string_strict),
+    cv.Required(CONF_VALUES): cv.All(cv.ensure_list(CSV_VALUE_SCHEMA), cv.Length(min=1, max=64)),
+})
+
+
+@automation.register_action("sd_spi_card.csv_append", CsvAppendAction, CSV_APPEND_ACTION_SCHEMA)
+async def csv_append_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    # Constant paths/text stay literals so play() does not build strings
+    if isinstance(config[CONF_PATH], Lambda):
+        path = await cg.templatable(config[CONF_PATH], args, cg.std_string)
+        cg.add(var.set_path(path))
+    else:
+        cg.add(var.set_static_path(config[CONF_PATH]))
+    for column in config[CONF_VALUES]:
+        col_type = column[CONF_TYPE]
+        if col_type == "int":
+            value = await cg.templatable(column[CONF_VALUE], args, cg.int64)
+            cg.add(var.add_int_column(value))
+        elif col_type == "float":
+            value = await cg.templatable(column[CONF_VALUE], args, cg.float_)
+            cg.add(var.add_float_column(value, column[CONF_DECIMALS]))
+        elif col_type == "timestamp" and CONF_VALUE in column:
+            value = await cg.templatable(column[CONF_VALUE], args, cg.int64)
+            cg.add(var.add_timestamp_column(value))
+        elif col_type == "timestamp":
+            cg.add(var.add_now_column())
+        elif isinstance(column[CONF_VALUE], Lambda):
+            value = await cg.templatable(column[CONF_VALUE], args, cg.std_string)
+            cg.add(var.add_string_column(value))
+        else:
+            cg.add(var.add_static_string_column(column[CONF_VALUE]))
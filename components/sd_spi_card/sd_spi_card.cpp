@@ -1,14 +1,193 @@
 #include "sd_spi_card.h"
 #include "esphome/core/log.h"
+#include "esphome/core/helpers.h"
 #include "ff.h"   // FatFs
+#include "diskio_impl.h"
+#include "diskio_sdmmc.h"
+#include <algorithm>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "soc/soc_caps.h"
 
 
 namespace esphome {
 namespace sd_spi_card {
 
 static const char *const TAG = "sd_spi_card";
-static const char* MOUNT_POINT = "/sdcard";
-std::string build_path(const char *path) {return std::string(MOUNT_POINT) + path;}
+
+// One lock per SPI host, shared by every card on that host. Recursive because
+// the helpers call each other (keep_last_n -> row_count, failure -> remount).
+static SemaphoreHandle_t bus_lock_for(spi_host_device_t host) {
+  static SemaphoreHandle_t locks[SOC_SPI_PERIPH_NUM] = {};
+  if (locks[host] == nullptr) locks[host] = xSemaphoreCreateRecursiveMutex();
+  return locks[host];
+}
+
+class ReadAhead;
+
+// Holds the bus lock for one card operation. Long scans call tick() so that
+// after every burst_size bytes other tasks (httpd export, other cards on the
+// host) get a turn instead of waiting for the whole file.
+class BusGuard {
+ public:
+  explicit BusGuard(SdSpiCard *card) : card_(card) { card_->lock_bus(); }
+  ~BusGuard() { card_->unlock_bus(); }
+  void tick(size_t bytes, ReadAhead &in);
+
+ protected:
+  SdSpiCard *card_;
+  size_t burst_{0};
+};
+
+FileInfo::FileInfo(std::string const &path, size_t size, bool is_directory, time_t mtime)
+    : path(path), size(size), is_directory(is_directory), mtime(mtime) {}
+
+// FAT packs local date/time into two 16-bit words
+static time_t fat_time_to_epoch(WORD fdate, WORD ftime) {
+  struct tm t = {};
+  t.tm_year = ((fdate >> 9) & 0x7F) + 80;
+  t.tm_mon = ((fdate >> 5) & 0x0F) - 1;
+  t.tm_mday = fdate & 0x1F;
+  t.tm_hour = (ftime >> 11) & 0x1F;
+  t.tm_min = (ftime >> 5) & 0x3F;
+  t.tm_sec = (ftime & 0x1F) * 2;
+  t.tm_isdst = -1;
+  return mktime(&t);
+}
+
+static unsigned rows_per_second(int rows, uint32_t start_ms) {
+  uint32_t ms = millis() - start_ms;
+  return ms > 0 ? (unsigned) ((uint64_t) rows * 1000 / ms) : (unsigned) rows * 1000;
+}
+
+// Row filter parsed from ">5", "<=2.3", "!=0", "=0", "10-20"
+struct CsvCondition {
+  bool enabled{false};
+  bool between{false};
+  char op[3] = {0};
+  float target{0.0f};
+  float target2{0.0f};
+};
+
+static CsvCondition parse_csv_condition(const char *condition) {
+  CsvCondition c;
+  if (condition == nullptr || strlen(condition) == 0) return c;
+  c.enabled = true;
+  if (sscanf(condition, "%f - %f", &c.target, &c.target2) == 2 ||
+      sscanf(condition, "%f--%f", &c.target, &c.target2) == 2) {
+    c.between = true;
+  } else if (sscanf(condition, "%2[<>=!]%f", c.op, &c.target) < 1) {
+    ESP_LOGW(TAG, "Invalid condition: %s", condition);
+    c.enabled = false;
+  }
+  return c;
+}
+
+static bool csv_condition_keep(const CsvCondition &c, float val) {
+  if (c.between) return val >= c.target && val <= c.target2;
+  if (strcmp(c.op, ">") == 0) return val > c.target;
+  if (strcmp(c.op, "<") == 0) return val < c.target;
+  if (strcmp(c.op, ">=") == 0) return val >= c.target;
+  if (strcmp(c.op, "<=") == 0) return val <= c.target;
+  if (strcmp(c.op, "=") == 0) return val == c.target;
+  if (strcmp(c.op, "!=") == 0) return val != c.target;
+  return false;
+}
+
+// Field walker shared by every CSV reader, filter and export, so a column
+// index means the same thing everywhere: fields split at ',' and, as the
+// original strtok loops did, empty fields are skipped. Returns the field
+// starting at or after p (nullptr at the end) and its length; continue from
+// the returned pointer + len. The line itself is never modified.
+static const char *csv_next_field(const char *p, size_t &len) {
+  while (*p == ',') p++;
+  if (*p == '\0') return nullptr;
+  len = strcspn(p, ",");
+  return p;
+}
+
+// Numeric value of column col in a raw CSV line
+static bool csv_column_value(const char *line, int col, float &out) {
+  size_t len = 0;
+  const char *field = csv_next_field(line, len);
+  for (int i = 0; i < col && field != nullptr; i++) field = csv_next_field(field + len, len);
+  if (field == nullptr) return false;
+  out = atof(field);
+  return true;
+}
+
+static const char *const JOURNAL_PATH = "/.sdspi_journal";
+
+// CRC-16/CCITT-FALSE
+static uint16_t crc16(const char *data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint8_t) data[i] << 8;
+    for (int b = 0; b < 8; b++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// Position of a ",*HHHH" record checksum at the end of line, or -1
+static int find_record_suffix(const char *line, size_t len) {
+  if (len < RECORD_SUFFIX_LEN) return -1;
+  const char *sfx = line + len - RECORD_SUFFIX_LEN;
+  if (sfx[0] != ',' || sfx[1] != '*') return -1;
+  for (int i = 2; i < (int) RECORD_SUFFIX_LEN; i++) {
+    if (!isxdigit((unsigned char) sfx[i])) return -1;
+  }
+  return len - RECORD_SUFFIX_LEN;
+}
+
+static bool record_suffix_matches(const char *line, int pos) {
+  char hex[5] = {line[pos + 2], line[pos + 3], line[pos + 4], line[pos + 5], '\0'};
+  return strtoul(hex, nullptr, 16) == crc16(line, pos);
+}
+
+// Drop the checksum column from a line as read by fgets, keeping its line
+// ending. Only a matching checksum counts, so a data column that merely looks
+// like "*BEEF" stays. Applied whether or not checksums are enabled right now.
+static void strip_record_suffix(char *line) {
+  size_t content = strcspn(line, "\r\n");
+  int pos = find_record_suffix(line, content);
+  if (pos < 0 || !record_suffix_matches(line, pos)) return;
+  memmove(line + pos, line + content, strlen(line + content) + 1);
+}
+
+// Lines without a checksum (written before checksums were enabled) pass
+static bool record_valid(const char *line, size_t len) {
+  if (len > 0 && line[len - 1] == '\r') len--;
+  int pos = find_record_suffix(line, len);
+  if (pos < 0) return memchr(line, '\0', len) == nullptr;
+  return record_suffix_matches(line, pos);
+}
+
+// '*' and '?' glob, case-insensitive like FAT itself
+static bool glob_match(const char *pattern, const char *name) {
+  const char *star = nullptr, *resume = nullptr;
+  while (*name) {
+    if (*pattern == '*') {
+      star = pattern++;
+      resume = name;
+    } else if (*pattern == '?' || tolower((unsigned char) *pattern) == tolower((unsigned char) *name)) {
+      pattern++;
+      name++;
+    } else if (star) {
+      pattern = star + 1;
+      name = ++resume;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*') pattern++;
+  return *pattern == '\0';
+}
 
 
 
@@ -20,48 +199,38 @@ void SdSpiCard::setup() {
 #endif
 
   ESP_LOGI(TAG, "Mounting SD card via SDSPI...");
-
-  // Configure host
-  sdmmc_host_t host = SDSPI_HOST_DEFAULT();
-  host.slot = VSPI_HOST;
-  host.max_freq_khz = this->spi_freq_khz_;  
-
-  // Convert pins
-  int mosi = static_cast<InternalGPIOPin*>(this->mosi_pin_)->get_pin();
-  int miso = static_cast<InternalGPIOPin*>(this->miso_pin_)->get_pin();
-  int clk  = static_cast<InternalGPIOPin*>(this->clk_pin_)->get_pin();
-  int cs   = static_cast<InternalGPIOPin*>(this->cs_pin_)->get_pin();
-
-  // SPI bus config
-  spi_bus_config_t bus_cfg = {
-      .mosi_io_num = mosi,
-      .miso_io_num = miso,
-      .sclk_io_num = clk,
-      .quadwp_io_num = -1,
-      .quadhd_io_num = -1,
-      .max_transfer_sz = 4000,
-  };
-
-  ESP_ERROR_CHECK(spi_bus_initialize((spi_host_device_t) host.slot, &bus_cfg, SDSPI_DEFAULT_DMA));
-
-  // Device config
-  sdspi_device_config_t slot_config = SDSPI_DEVICE_CONFIG_DEFAULT();
-  slot_config.gpio_cs = (gpio_num_t) cs;
-  slot_config.host_id = (spi_host_device_t) host.slot;
-
-  // Mount config
-  esp_vfs_fat_sdmmc_mount_config_t mount_config = {
-      .format_if_mount_failed = false,
-      .max_files = 5,
-      .allocation_unit_size = 16 * 1024
-  };
-
-  esp_err_t ret = esp_vfs_fat_sdspi_mount(MOUNT_POINT, &host, &slot_config, &mount_config, &this->card_);
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to mount SD card: %s", esp_err_to_name(ret));
-  } else {
-    ESP_LOGI(TAG, "SD card mounted at /sdcard (freq=%d kHz)", this->spi_freq_khz_);
+  this->bus_lock_ = bus_lock_for(this->spi_host_);
+
+  // Without our own pins the bus belongs to an ESPHome spi: component
+  if (this->clk_pin_ != nullptr) {
+    int mosi = static_cast<InternalGPIOPin*>(this->mosi_pin_)->get_pin();
+    int miso = static_cast<InternalGPIOPin*>(this->miso_pin_)->get_pin();
+    int clk  = static_cast<InternalGPIOPin*>(this->clk_pin_)->get_pin();
+
+    spi_bus_config_t bus_cfg = {
+        .mosi_io_num = mosi,
+        .miso_io_num = miso,
+        .sclk_io_num = clk,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = 4000,
+    };
+
+    esp_err_t err = spi_bus_initialize(this->spi_host_, &bus_cfg, SDSPI_DEFAULT_DMA);
+    if (err == ESP_ERR_INVALID_STATE) {
+      // Another card on the same host got there first
+      ESP_LOGI(TAG, "SPI host %d already initialized, sharing it", (int) this->spi_host_);
+    } else if (err != ESP_OK) {
+      ESP_LOGE(TAG, "SPI bus init failed: %s", esp_err_to_name(err));
+      this->mark_failed();
+      return;
+    } else {
+      this->owns_bus_ = true;
+    }
   }
+
+  this->spill_persist_load();
+  this->mount_card();
 #endif
 
 // update binary sensor
@@ -78,6 +247,15 @@ void SdSpiCard::setup() {
 void SdSpiCard::dump_config() {
   ESP_LOGCONFIG(TAG, "SD SPI Card:");
   ESP_LOGCONFIG(TAG, "  SPI Freq: %d kHz", this->spi_freq_khz_);
+  ESP_LOGCONFIG(TAG, "  SPI Host: %d (%s)", (int) this->spi_host_, this->owns_bus_ ? "owned" : "shared");
+  ESP_LOGCONFIG(TAG, "  Mount Point: %s", this->mount_point_.c_str());
+  ESP_LOGCONFIG(TAG, "  Burst Size: %u bytes", (unsigned) this->burst_size_);
+  ESP_LOGCONFIG(TAG, "  Record Checksums: %s", this->checksums_ ? "yes" : "no");
+  ESP_LOGCONFIG(TAG, "  Last Recovery: %u ms", (unsigned) this->last_recovery_ms_);
+  if (this->spill_max_bytes_ > 0) {
+    ESP_LOGCONFIG(TAG, "  Spill Queue: %u bytes, NVS slots: %u", (unsigned) this->spill_max_bytes_,
+                  (unsigned) this->spill_persist_slots_);
+  }
   if (this->card_ == nullptr) {
     ESP_LOGE(TAG, "Not mounted.");
   } else {
@@ -87,7 +265,8 @@ void SdSpiCard::dump_config() {
 }
 
 size_t SdSpiCard::file_size(const char *path) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
+  BusGuard guard(this);
+  std::string full_path = this->mount_point_ + path;
   FILE *f = fopen(full_path.c_str(), "rb");
   if (!f) {
     ESP_LOGE(TAG, "Failed to open file %s", path);
@@ -99,6 +278,428 @@ size_t SdSpiCard::file_size(const char *path) {
   return size;
 }
 
+// Read-ahead resources of one card: `count` DMA-capable blocks, the queues
+// between caller and helper, and the helper task itself. Made on the first
+// scan and kept for the card's lifetime, so scans (keep_last_n reads the file
+// twice, exports, periodic rewrites) do not each spawn a task and allocate
+// DMA memory. One ReadAhead at a time owns it.
+struct ReadAheadPool {
+  std::vector<uint8_t *> buffers;
+  size_t size{0};
+  QueueHandle_t start_q{nullptr};  // ReadAhead the helper serves next
+  QueueHandle_t free_q{nullptr};
+  QueueHandle_t full_q{nullptr};
+  SemaphoreHandle_t done{nullptr};
+  SemaphoreHandle_t io{nullptr};     // held by the helper for each block read
+  SemaphoreHandle_t owner{nullptr};  // held by the ReadAhead using the pool
+  bool threaded{false};
+};
+
+// Sequential reader over the card's read-ahead pool. A helper task reads the
+// next multi-sector block from the card while the caller parses the current
+// one (ping-pong for count = 2). With a single buffer, or if the task could
+// not be created, blocks are read synchronously on the caller's task. A scan
+// that finds the pool in use (e.g. an httpd export during a rewrite) reads
+// synchronously into a small buffer of its own rather than wait for it.
+// Owns the FILE: close() (or the destructor) stops the helper, then closes it.
+//
+// By default the helper reads under the caller's bus lock, so the caller must
+// pause() it before giving the bus up and resume() after taking it back. With
+// lock_per_block the reader takes the bus lock itself for each block (and the
+// final fclose), for callers that hold no lock while they consume the data.
+// A block read after the card was unmounted, or a short read with the
+// stream's error flag set, ends the file early and leaves failed() true.
+class ReadAhead {
+ public:
+  static constexpr size_t MAX_BUFFERS = 8;
+
+  // Unbuffered, so fread() goes from FatFs straight into our blocks
+  static FILE *open(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f != nullptr) setvbuf(f, nullptr, _IONBF, 0);
+    return f;
+  }
+
+  static ReadAheadPool *create_pool(size_t count, size_t size) {
+    auto *pool = new ReadAheadPool();
+    count = std::min(count, MAX_BUFFERS);
+    for (size_t i = 0; i < count; i++) {
+      auto *buf = (uint8_t *) heap_caps_malloc(size, MALLOC_CAP_DMA);
+      if (buf == nullptr) break;
+      pool->buffers.push_back(buf);
+    }
+    pool->owner = xSemaphoreCreateMutex();
+    if (pool->buffers.empty() || pool->owner == nullptr) {
+      ESP_LOGW(TAG, "Read-ahead: no DMA memory for %u byte buffers, using %u bytes", (unsigned) size,
+               (unsigned) sizeof(ReadAhead::fallback_));
+      for (auto *buf : pool->buffers) heap_caps_free(buf);
+      if (pool->owner != nullptr) vSemaphoreDelete(pool->owner);
+      delete pool;
+      return nullptr;
+    }
+    pool->size = size;
+    if (pool->buffers.size() < 2) return pool;
+
+    // One spare slot in free_q for the stop token
+    pool->start_q = xQueueCreate(1, sizeof(ReadAhead *));
+    pool->free_q = xQueueCreate(pool->buffers.size() + 1, sizeof(uint8_t));
+    pool->full_q = xQueueCreate(pool->buffers.size(), sizeof(Block));
+    pool->done = xSemaphoreCreateBinary();
+    pool->io = xSemaphoreCreateMutex();
+    pool->threaded = pool->start_q != nullptr && pool->free_q != nullptr && pool->full_q != nullptr &&
+                     pool->done != nullptr && pool->io != nullptr &&
+                     xTaskCreate(reader_task, "sd_readahead", 4096, pool, uxTaskPriorityGet(nullptr), nullptr) == pdPASS;
+    if (!pool->threaded) ESP_LOGW(TAG, "Read-ahead: cannot start helper task, reading synchronously");
+    return pool;
+  }
+
+  ReadAhead(SdSpiCard *card, FILE *f, bool lock_per_block = false, size_t max_block = SIZE_MAX)
+      : card_(card), mount_id_(card->get_mount_id()), lock_per_block_(lock_per_block), f_(f) {
+    ReadAheadPool *pool = card->read_ahead_pool();
+    if (pool == nullptr || xSemaphoreTake(pool->owner, 0) != pdTRUE) {
+      this->size_ = std::min(sizeof(this->fallback_), max_block);
+      return;
+    }
+    this->pool_ = pool;
+    this->size_ = std::min(pool->size, max_block);
+    if (!pool->threaded) return;
+
+    xQueueReset(pool->free_q);
+    xQueueReset(pool->full_q);
+    for (uint8_t i = 0; i < pool->buffers.size(); i++) xQueueSend(pool->free_q, &i, 0);
+    ReadAhead *self = this;
+    xQueueSend(pool->start_q, &self, portMAX_DELAY);
+    this->threaded_ = true;
+  }
+
+  ~ReadAhead() { this->close(); }
+
+  // Wait for a block read in flight to finish and hold the helper there
+  void pause() {
+    if (!this->threaded_ || this->paused_) return;
+    xSemaphoreTake(this->pool_->io, portMAX_DELAY);
+    this->paused_ = true;
+  }
+
+  void resume() {
+    if (!this->paused_) return;
+    this->paused_ = false;
+    xSemaphoreGive(this->pool_->io);
+  }
+
+  bool failed() const { return this->failed_; }
+  // Stop at the next block boundary, e.g. because the file's mount is gone
+  void abort() { this->failed_ = true; }
+
+  void close() {
+    if (this->f_ == nullptr) return;
+    if (this->threaded_) {
+      this->resume();
+      this->stop_ = true;
+      uint8_t token = 0;
+      xQueueSend(this->pool_->free_q, &token, 0);
+      xSemaphoreTake(this->pool_->done, portMAX_DELAY);
+      this->threaded_ = false;
+    }
+    if (this->pool_ != nullptr) {
+      xSemaphoreGive(this->pool_->owner);
+      this->pool_ = nullptr;
+    }
+    if (this->lock_per_block_) this->card_->lock_bus();
+    fclose(this->f_);
+    if (this->lock_per_block_) this->card_->unlock_bus();
+    this->f_ = nullptr;
+  }
+
+  // Next block of the file; data stays valid until the following call
+  bool next_block(const uint8_t *&data, size_t &len) {
+    if (this->eof_ || this->failed_) return false;
+    if (!this->threaded_) {
+      uint8_t *buf = this->pool_ == nullptr ? this->fallback_ : this->pool_->buffers[0];
+      len = this->read_block(buf);
+      data = buf;
+    } else {
+      if (this->held_ >= 0) {
+        uint8_t index = this->held_;
+        xQueueSend(this->pool_->free_q, &index, portMAX_DELAY);
+      }
+      Block b;
+      xQueueReceive(this->pool_->full_q, &b, portMAX_DELAY);
+      this->held_ = b.index;
+      data = this->pool_->buffers[b.index];
+      len = b.len;
+    }
+    if (len == 0) this->eof_ = true;
+    return len > 0;
+  }
+
+  // Same contract as fgets(out, cap, f)
+  char *gets(char *out, size_t cap) {
+    size_t n = 0;
+    while (n + 1 < cap) {
+      if (this->pos_ >= this->len_) {
+        if (!this->next_block(this->cur_, this->len_)) break;
+        this->pos_ = 0;
+      }
+      const uint8_t *start = this->cur_ + this->pos_;
+      size_t avail = std::min(this->len_ - this->pos_, cap - 1 - n);
+      auto *nl = (const uint8_t *) memchr(start, '\n', avail);
+      size_t take = nl != nullptr ? nl - start + 1 : avail;
+      memcpy(out + n, start, take);
+      n += take;
+      this->pos_ += take;
+      if (nl != nullptr) break;
+    }
+    if (n == 0) return nullptr;
+    out[n] = '\0';
+    return out;
+  }
+
+ protected:
+  struct Block {
+    uint8_t index;
+    size_t len;
+  };
+
+  // One block, or none once the mount the file was opened on is gone
+  size_t read_block(uint8_t *buf) {
+    if (this->lock_per_block_) this->card_->lock_bus();
+    size_t len = 0;
+    if (this->failed_ || this->card_->get_mount_id() != this->mount_id_) {
+      this->failed_ = true;
+    } else {
+      len = fread(buf, 1, this->size_, this->f_);
+      if (len < this->size_ && ferror(this->f_)) this->failed_ = true;
+    }
+    if (this->lock_per_block_) this->card_->unlock_bus();
+    return len;
+  }
+
+  // Parked on start_q between files; serves one ReadAhead until it stops
+  static void reader_task(void *arg) {
+    auto *pool = (ReadAheadPool *) arg;
+    ReadAhead *self;
+    while (xQueueReceive(pool->start_q, &self, portMAX_DELAY) == pdTRUE) {
+      uint8_t index;
+      while (xQueueReceive(pool->free_q, &index, portMAX_DELAY) == pdTRUE && !self->stop_) {
+        xSemaphoreTake(pool->io, portMAX_DELAY);
+        Block b{index, self->read_block(pool->buffers[index])};
+        xSemaphoreGive(pool->io);
+        xQueueSend(pool->full_q, &b, portMAX_DELAY);
+        if (b.len == 0) break;
+      }
+      xSemaphoreGive(pool->done);
+    }
+  }
+
+  SdSpiCard *card_;
+  uint32_t mount_id_;
+  bool lock_per_block_;
+  FILE *f_;
+  size_t size_;
+  ReadAheadPool *pool_{nullptr};
+  volatile bool stop_{false};
+  volatile bool failed_{false};
+  bool threaded_{false};
+  bool paused_{false};
+  bool eof_{false};
+  int held_{-1};
+  const uint8_t *cur_{nullptr};
+  size_t len_{0};
+  size_t pos_{0};
+  uint8_t fallback_[512];
+};
+
+ReadAheadPool *SdSpiCard::read_ahead_pool() {
+  if (this->read_ahead_pool_ == nullptr)
+    this->read_ahead_pool_ = ReadAhead::create_pool(this->read_ahead_count_, this->read_ahead_size_);
+  return this->read_ahead_pool_;
+}
+
+// The helper reads under our lock, so park it before handing the bus over.
+// If the card was unmounted meanwhile, the file is dead: stop reading.
+void BusGuard::tick(size_t bytes, ReadAhead &in) {
+  this->burst_ += bytes;
+  if (this->burst_ < card_->get_burst_size()) return;
+  this->burst_ = 0;
+  in.pause();
+  if (!card_->yield_bus()) in.abort();
+  in.resume();
+}
+
+// --- Bus arbitration ---
+
+void SdSpiCard::lock_bus() {
+  if (this->bus_lock_ == nullptr) return;
+  xSemaphoreTakeRecursive(this->bus_lock_, portMAX_DELAY);
+  this->bus_lock_depth_++;
+}
+
+void SdSpiCard::unlock_bus() {
+  if (this->bus_lock_ == nullptr) return;
+  this->bus_lock_depth_--;
+  xSemaphoreGiveRecursive(this->bus_lock_);
+}
+
+// Only the outermost holder can actually hand the bus over
+bool SdSpiCard::yield_bus() {
+  if (this->bus_lock_ == nullptr || this->bus_lock_depth_ != 1) return true;
+  uint32_t mount_id = this->mount_id_;
+  this->unlock_bus();
+  taskYIELD();
+  this->lock_bus();
+  return this->mount_id_ == mount_id;
+}
+
+// --- Directory listing ---
+
+std::string SdSpiCard::fatfs_path(const std::string &path) const {
+  return std::string(this->fatfs_drive_) + (path.empty() ? "/" : path);
+}
+
+DirCursor SdSpiCard::list_directory_begin(const char *path, uint8_t max_depth, const char *pattern,
+                                          size_t page_size, bool include_directories) {
+  DirCursor cursor;
+  cursor.root = (path == nullptr || *path == '\0') ? "/" : path;
+  if (cursor.root.size() > 1 && cursor.root.back() == '/') cursor.root.pop_back();
+  cursor.pattern = pattern != nullptr ? pattern : "";
+  cursor.max_depth = max_depth;
+  cursor.page_size = page_size > 0 ? page_size : 1;
+  cursor.include_directories = include_directories;
+  cursor.stack.push_back({cursor.root, 0, 0});
+  return cursor;
+}
+
+// Fills page with up to cursor.page_size entries (depth-first, directory order)
+// and advances the cursor. Open directories stay in the cursor frames, so each
+// page picks up where the last one stopped; only after a remount does a frame
+// have to be reopened and skipped forward to its saved index.
+size_t SdSpiCard::list_directory_page(DirCursor &cursor, std::vector<FileInfo> &page) {
+  BusGuard guard(this);
+  page.clear();
+  if (cursor.done) return 0;
+  if (this->card_ == nullptr) {
+    ESP_LOGW(TAG, "List directory skipped: card not mounted");
+    return 0;
+  }
+
+  std::string key = cursor.root + '|' + cursor.pattern + '|' + std::to_string(cursor.max_depth) + '|' +
+                    std::to_string(cursor.page_size) + (cursor.include_directories ? "|d" : "|f");
+  for (auto &fr : cursor.stack) key += '|' + fr.dir + ':' + std::to_string(fr.next_index);
+  for (auto &entry : this->dir_cache_) {
+    if (entry.key == key) {
+      page = entry.page;
+      cursor = entry.next;
+      ESP_LOGD(TAG, "List %s: %d entries (cached)", cursor.root.c_str(), (int) page.size());
+      return page.size();
+    }
+  }
+
+  page.reserve(cursor.page_size);
+  FILINFO fno;
+
+  while (!cursor.stack.empty() && page.size() < cursor.page_size) {
+    DirCursor::Frame &top = cursor.stack.back();
+    std::string dir_path = top.dir;
+    uint8_t depth = top.depth;
+
+    bool exhausted = false;
+    FRESULT res = FR_OK;
+    if (top.mount_id != this->mount_id_) {
+      res = f_opendir(&top.handle, this->fatfs_path(dir_path).c_str());
+      if (res != FR_OK) {
+        ESP_LOGE(TAG, "Open directory failed: %s (%d)", dir_path.c_str(), res);
+        if (res == FR_DISK_ERR || res == FR_NOT_READY) {
+          this->handle_sd_failure("List directory");
+          return page.size();
+        }
+        cursor.stack.pop_back();
+        continue;
+      }
+      top.mount_id = this->mount_id_;
+
+      // Reopened after a remount: skip what earlier pages already returned
+      for (uint16_t i = 0; i < top.next_index; i++) {
+        res = f_readdir(&top.handle, &fno);
+        if (res != FR_OK) break;
+        if (fno.fname[0] == '\0') {
+          exhausted = true;
+          break;
+        }
+      }
+    }
+
+    bool descended = false;
+    while (!exhausted && res == FR_OK && page.size() < cursor.page_size) {
+      res = f_readdir(&top.handle, &fno);
+      if (res != FR_OK) break;
+      if (fno.fname[0] == '\0') {
+        exhausted = true;
+        break;
+      }
+      top.next_index++;
+      if (strcmp(fno.fname, ".") == 0 || strcmp(fno.fname, "..") == 0) continue;
+
+      bool is_dir = (fno.fattrib & AM_DIR) != 0;
+      std::string child = (dir_path == "/" ? "" : dir_path) + "/" + fno.fname;
+      bool matches = cursor.pattern.empty() || glob_match(cursor.pattern.c_str(), fno.fname);
+      if (matches && (!is_dir || cursor.include_directories)) {
+        page.emplace_back(child, is_dir ? 0 : (size_t) fno.fsize, is_dir, fat_time_to_epoch(fno.fdate, fno.ftime));
+      }
+      if (is_dir && depth < cursor.max_depth) {
+        // Descend now; `top` is invalidated by the push, so stop using it
+        cursor.stack.push_back({child, 0, (uint8_t) (depth + 1)});
+        descended = true;
+        break;
+      }
+    }
+
+    if (res != FR_OK) {
+      // Not the end of the directory: keep the frame, the remount makes the
+      // next page reopen it and carry on from next_index
+      ESP_LOGE(TAG, "Read directory failed: %s (%d)", dir_path.c_str(), res);
+      this->handle_sd_failure("List directory");
+      return page.size();
+    }
+    if (exhausted && !descended) {
+      f_closedir(&top.handle);
+      cursor.stack.pop_back();
+    }
+  }
+  cursor.done = cursor.stack.empty();
+
+  DirCacheEntry entry{key, cursor.root, page, cursor};
+  if (this->dir_cache_.size() < DIR_CACHE_SIZE) {
+    this->dir_cache_.push_back(std::move(entry));
+  } else {
+    this->dir_cache_[this->dir_cache_next_] = std::move(entry);
+    this->dir_cache_next_ = (this->dir_cache_next_ + 1) % DIR_CACHE_SIZE;
+  }
+
+  ESP_LOGD(TAG, "List %s: %d entries%s", cursor.root.c_str(), (int) page.size(), cursor.done ? " (done)" : "");
+  return page.size();
+}
+
+// Drop cached pages whose walk could include path
+void SdSpiCard::invalidate_dir_cache(const char *path) {
+  if (this->dir_cache_.empty()) return;
+  if (path == nullptr) {
+    this->dir_cache_.clear();
+    this->dir_cache_next_ = 0;
+    return;
+  }
+  for (size_t i = 0; i < this->dir_cache_.size();) {
+    const std::string &root = this->dir_cache_[i].root;
+    bool under = root == "/" || (strncmp(path, root.c_str(), root.size()) == 0 && path[root.size()] == '/');
+    if (under) {
+      this->dir_cache_.erase(this->dir_cache_.begin() + i);
+    } else {
+      i++;
+    }
+  }
+  this->dir_cache_next_ = 0;
+}
+
 #ifdef USE_SENSOR
 void SdSpiCard::add_file_size_sensor(sensor::Sensor *s, const char *path) {
   file_size_sensors_.push_back(FileSizeSensor(s, std::string(path)));
@@ -107,6 +708,11 @@ void SdSpiCard::add_file_size_sensor(sensor::Sensor *s, const char *path) {
 
 void SdSpiCard::update_sensors() {
  #ifdef USE_SENSOR
+  BusGuard guard(this);
+
+  if (this->spill_queued_sensor_ != nullptr) this->spill_queued_sensor_->publish_state(this->spill_queued_);
+  if (this->spill_replayed_sensor_ != nullptr) this->spill_replayed_sensor_->publish_state(this->spill_replayed_);
+  if (this->spill_dropped_sensor_ != nullptr) this->spill_dropped_sensor_->publish_state(this->spill_dropped_);
  
      // Case 1: No card mounted
   if (this->card_ == nullptr)
@@ -126,7 +732,7 @@ void SdSpiCard::update_sensors() {
   DWORD fre_clust, fre_sect, tot_sect;
   uint64_t total_bytes = -1, free_bytes = -1, used_bytes = -1;
   
-  FRESULT res = f_getfree(MOUNT_POINT, &fre_clust, &fs);
+  FRESULT res = f_getfree(this->fatfs_drive_, &fre_clust, &fs);
   if (res == FR_OK) {
     tot_sect = (fs->n_fatent - 2) * fs->csize;
     fre_sect = fre_clust * fs->csize;
@@ -162,16 +768,20 @@ void SdSpiCard::update_sensors() {
 // write & appent file 
 
 void SdSpiCard::append_file(const char *path, const char *line) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
-  FILE *f = fopen(full_path.c_str(), "a");
+  BusGuard guard(this);
+  this->invalidate_dir_cache(path);
+  // Spill at most once per row, or a rejected row is counted dropped twice
+  bool spill_tried = this->card_ == nullptr;
+  if (spill_tried && this->spill_append(path, line, strlen(line))) return;
+  std::string full_path = this->mount_point_ + path;
+  FILE *f = this->open_append(full_path, "File append");
   if (!f) {
-    ESP_LOGE(TAG, "Append failed: %s", full_path.c_str());
-    this->handle_sd_failure("File append");
+    if (!spill_tried && this->card_ == nullptr) this->spill_append(path, line, strlen(line));
     return;
   }
-  fputs(line, f);
-  fputc('\n', f);
+  this->write_record(f, line, strlen(line));
   fclose(f);
+  this->note_appended(path);
   ESP_LOGI(TAG, "Appended to %s: %s", full_path.c_str(), line);
 }
 
@@ -179,13 +789,16 @@ void SdSpiCard::append_file(const char *path, const char *line) {
 
 //write file
 void SdSpiCard::write_file(const char *path, const char *line) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
+  BusGuard guard(this);
+  this->invalidate_dir_cache(path);
+  std::string full_path = this->mount_point_ + path;
   FILE *f = fopen(full_path.c_str(), "w");
   if (!f) {
     ESP_LOGE(TAG, "Write failed: %s", full_path.c_str());
     this->handle_sd_failure("Write file");
     return;
   }
+  // Whole-file content, not a record: no checksum column
   fputs(line, f);
   fputc('\n', f);
   fclose(f);
@@ -194,7 +807,9 @@ void SdSpiCard::write_file(const char *path, const char *line) {
 
 
 bool SdSpiCard::delete_file(const char *path) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
+  BusGuard guard(this);
+  this->invalidate_dir_cache(path);
+  std::string full_path = this->mount_point_ + path;
   if (remove(full_path.c_str()) == 0) {
     ESP_LOGI(TAG, "Deleted file: %s", full_path.c_str());
     return true;
@@ -205,15 +820,103 @@ bool SdSpiCard::delete_file(const char *path) {
   }
 }
 
-// Append a row in csv
-bool SdSpiCard::csv_append_row(const char *path, const std::vector<std::string> &cells) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
-  FILE *f = fopen(full_path.c_str(), "a");
-  if (!f) {
-    ESP_LOGE(TAG, "Row append failed: %s", full_path.c_str());
-    this->handle_sd_failure("Row append failed");
+// --- Typed CSV line formatting ---
+
+void CsvLine::append(const char *s, size_t n) {
+  if (this->len + n > MAX_LEN) {
+    this->overflow = true;
+    return;
+  }
+  memcpy(this->buf + this->len, s, n);
+  this->len += n;
+}
+
+void CsvLine::append_text(const char *s, size_t n) {
+  if (memchr(s, ',', n) != nullptr || memchr(s, '\n', n) != nullptr || memchr(s, '\r', n) != nullptr) {
+    this->invalid = true;
+    return;
+  }
+  this->append(s, n);
+}
+
+void CsvLine::append_int(int64_t v) {
+  char digits[20];
+  int n = 0;
+  uint64_t mag = v < 0 ? 0 - (uint64_t) v : (uint64_t) v;
+  do {
+    digits[n++] = '0' + mag % 10;
+    mag /= 10;
+  } while (mag > 0);
+  if (v < 0) this->append("-", 1);
+  char out[20];
+  for (int i = 0; i < n; i++) out[i] = digits[n - 1 - i];
+  this->append(out, n);
+}
+
+// Integer arithmetic only; newlib's %f path may allocate
+void CsvLine::append_fixed(float v, uint8_t decimals) {
+  static const uint32_t POW10[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+  if (std::isnan(v)) {
+    this->append("nan");
+    return;
+  }
+  if (decimals > 6) decimals = 6;
+  double scaled = std::fabs((double) v) * POW10[decimals] + 0.5;
+  if (std::isinf(v) || scaled >= 9.2e18) {
+    this->append(v < 0 ? "-inf" : "inf");
+    return;
+  }
+  uint64_t fixed = (uint64_t) scaled;
+  if (v < 0 && fixed != 0) this->append("-", 1);
+  this->append_int((int64_t) (fixed / POW10[decimals]));
+  if (decimals == 0) return;
+  uint32_t frac = fixed % POW10[decimals];
+  char out[7];
+  for (int i = decimals - 1; i >= 0; i--) {
+    out[i] = '0' + frac % 10;
+    frac /= 10;
+  }
+  this->append(".", 1);
+  this->append(out, decimals);
+}
+
+void CsvLine::append_time(time_t t) {
+  struct tm tm;
+  char out[20];
+  localtime_r(&t, &tm);
+  size_t n = strftime(out, sizeof(out), "%Y-%m-%d %H:%M:%S", &tm);
+  this->append(out, n);
+}
+
+// Append a pre-formatted row in csv
+bool SdSpiCard::csv_append_line(const char *path, const CsvLine &line) {
+  if (line.overflow) {
+    ESP_LOGE(TAG, "Row append to %s rejected: row longer than %u bytes", path, (unsigned) CsvLine::MAX_LEN);
     return false;
   }
+  if (line.invalid) {
+    ESP_LOGE(TAG, "Row append to %s rejected: text cell contains ',' or a line break", path);
+    return false;
+  }
+  BusGuard guard(this);
+  this->invalidate_dir_cache(path);
+  bool spill_tried = this->card_ == nullptr;
+  if (spill_tried && this->spill_append(path, line.buf, line.len)) return true;
+  std::string full_path = this->mount_point_ + path;
+  FILE *f = this->open_append(full_path, "Row append");
+  if (!f) return !spill_tried && this->card_ == nullptr && this->spill_append(path, line.buf, line.len);
+  this->write_record(f, line.buf, line.len);
+  fclose(f);
+  this->note_appended(path);
+
+  ESP_LOGI(TAG, "Row appended to %s: %.*s", full_path.c_str(), (int) line.len, line.buf);
+  return true;
+}
+
+// Append a row in csv
+bool SdSpiCard::csv_append_row(const char *path, const std::vector<std::string> &cells) {
+  BusGuard guard(this);
+  this->invalidate_dir_cache(path);
 
   // Build line in memory for log + write
   std::string line;
@@ -222,9 +925,15 @@ bool SdSpiCard::csv_append_row(const char *path, const std::vector<std::string>
     if (i < cells.size() - 1) line += ",";
   }
 
-  fputs(line.c_str(), f);
-  fputc('\n', f);
+  bool spill_tried = this->card_ == nullptr;
+  if (spill_tried && this->spill_append(path, line.c_str(), line.size())) return true;
+  std::string full_path = this->mount_point_ + path;
+  FILE *f = this->open_append(full_path, "Row append");
+  if (!f) return !spill_tried && this->card_ == nullptr && this->spill_append(path, line.c_str(), line.size());
+
+  this->write_record(f, line.c_str(), line.size());
   fclose(f);
+  this->note_appended(path);
 
   ESP_LOGI(TAG, "Row appended to %s: %s", full_path.c_str(), line.c_str());
   return true;
@@ -232,71 +941,92 @@ bool SdSpiCard::csv_append_row(const char *path, const std::vector<std::string>
 
 // Count total rows
 int SdSpiCard::csv_row_count(const char *path) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
-  FILE *f = fopen(full_path.c_str(), "r");
+  BusGuard guard(this);
+  std::string full_path = this->mount_point_ + path;
+  FILE *f = ReadAhead::open(full_path);
   if (!f) {
     ESP_LOGE(TAG, "Row count failed, file not found: %s", full_path.c_str());
     this->handle_sd_failure("Row count failed");
     return -1;
   }
+  ReadAhead in(this, f);
+  uint32_t start = millis();
   int count = 0;
   char buf[256];
-  while (fgets(buf, sizeof(buf), f)) count++;
-  fclose(f);
-  ESP_LOGI(TAG, "Row count for %s: %d", full_path.c_str(), count);
+  while (in.gets(buf, sizeof(buf))) {
+    count++;
+    guard.tick(strlen(buf), in);
+  }
+  in.close();
+  if (in.failed()) {
+    ESP_LOGE(TAG, "Row count failed, read error in %s after %d rows", full_path.c_str(), count);
+    return -1;
+  }
+  ESP_LOGI(TAG, "Row count for %s: %d (%u rows/s)", full_path.c_str(), count, rows_per_second(count, start));
   return count;
 }
 
 // replace a col of a specific row
 bool SdSpiCard::csv_replace_col(const char *path, int row_index, int col_index, const char *new_value) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
-  FILE *fin = fopen(full_path.c_str(), "r");
+  BusGuard guard(this);
+  this->invalidate_dir_cache(path);
+  std::string full_path = this->mount_point_ + path;
+  FILE *fin = ReadAhead::open(full_path);
   if (!fin) {
     ESP_LOGE(TAG, "Replace col failed, file not found: %s", full_path.c_str());
     return false;
   }
 
   std::string tmp_path = full_path + ".tmp";
+  if (!this->begin_rewrite(path)) {
+    fclose(fin);
+    return false;
+  }
   FILE *fout = fopen(tmp_path.c_str(), "w");
   if (!fout) {
     fclose(fin);
+    this->end_rewrite();
     ESP_LOGE(TAG, "Replace col failed, cannot open temp file: %s", tmp_path.c_str());
     return false;
   }
 
+  ReadAhead in(this, fin);
+  setvbuf(fout, nullptr, _IOFBF, this->read_ahead_size_);
   char buf[256];
   int row = 0;
 
-  while (fgets(buf, sizeof(buf), fin)) {
+  while (in.gets(buf, sizeof(buf))) {
     if (row == row_index) {
-      // Replace specific column
-      char *saveptr;
-      char *token = strtok_r(buf, ",", &saveptr);
+      // Replace specific column; the newline and any old checksum are re-added below
+      strip_record_suffix(buf);
+      buf[strcspn(buf, "\r\n")] = '\0';
       char new_line[256] = {0};
       int col = 0;
+      size_t field_len = 0;
 
-      while (token != nullptr) {
+      for (const char *field = csv_next_field(buf, field_len); field != nullptr;
+           field = csv_next_field(field + field_len, field_len)) {
         if (col > 0) strcat(new_line, ",");
         if (col == col_index) {
           strcat(new_line, new_value);
         } else {
-          strcat(new_line, token);
+          strncat(new_line, field, field_len);
         }
-        token = strtok_r(nullptr, ",", &saveptr);
         col++;
       }
-      strcat(new_line, "\n");
-      fputs(new_line, fout);
+      char suffix[RECORD_SUFFIX_LEN + 1];
+      size_t len = strlen(new_line);
+      fwrite(new_line, 1, len, fout);
+      fwrite(suffix, 1, this->record_suffix(new_line, len, suffix), fout);
+      fputc('\n', fout);
     } else {
       fputs(buf, fout);
     }
     row++;
   }
 
-  fclose(fin);
-  fclose(fout);
-  remove(full_path.c_str());
-  rename(tmp_path.c_str(), full_path.c_str());
+  in.close();
+  if (!this->commit_rewrite(fout, full_path, tmp_path, !in.failed())) return false;
 
   ESP_LOGI(TAG, "Replaced row %d col %d in %s with '%s'", row_index, col_index, full_path.c_str(), new_value);
   return true;
@@ -306,34 +1036,41 @@ bool SdSpiCard::csv_replace_col(const char *path, int row_index, int col_index,
 
 // Delete range of rows [row_start, row_end]
 bool SdSpiCard::csv_delete_rows(const char *path, int row_start, int row_end) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
-  FILE *fin = fopen(full_path.c_str(), "r");
+  BusGuard guard(this);
+  this->invalidate_dir_cache(path);
+  std::string full_path = this->mount_point_ + path;
+  FILE *fin = ReadAhead::open(full_path);
   if (!fin) {
     ESP_LOGE(TAG, "Delete rows failed, file not found: %s", full_path.c_str());
     this->handle_sd_failure("Delete rows failed");
     return false;
   }
   std::string tmp_path = full_path + ".tmp";
+  if (!this->begin_rewrite(path)) {
+    fclose(fin);
+    return false;
+  }
   FILE *fout = fopen(tmp_path.c_str(), "w");
   if (!fout) {
     fclose(fin);
+    this->end_rewrite();
     ESP_LOGE(TAG, "Delete rows failed, cannot open temp file: %s", tmp_path.c_str());
     this->handle_sd_failure("Delete rows failed, cannot open temp file");
     return false;
   }
 
+  ReadAhead in(this, fin);
+  setvbuf(fout, nullptr, _IOFBF, this->read_ahead_size_);
   char buf[256];
   int row = 0;
-  while (fgets(buf, sizeof(buf), fin)) {
+  while (in.gets(buf, sizeof(buf))) {
     if (row < row_start || row > row_end) {
       fputs(buf, fout);
     }
     row++;
   }
-  fclose(fin);
-  fclose(fout);
-  remove(full_path.c_str());
-  rename(tmp_path.c_str(), full_path.c_str());
+  in.close();
+  if (!this->commit_rewrite(fout, full_path, tmp_path, !in.failed())) return false;
 
   ESP_LOGI(TAG, "Deleted rows %d–%d from %s", row_start, row_end, full_path.c_str());
   return true;
@@ -341,37 +1078,45 @@ bool SdSpiCard::csv_delete_rows(const char *path, int row_start, int row_end) {
 
 // Keep only last N rows
 bool SdSpiCard::csv_keep_last_n(const char *path, int max_rows) {
-  std::string full_path = std::string(MOUNT_POINT) + path;
+  BusGuard guard(this);
+  this->invalidate_dir_cache(path);
+  std::string full_path = this->mount_point_ + path;
   int total = csv_row_count(path);
+  if (total < 0) return false;
   if (total <= max_rows) {
     ESP_LOGI(TAG, "Keep last %d rows skipped, %s already within limit (%d)", max_rows, full_path.c_str(), total);
     return true;
   }
 
-  FILE *fin = fopen(full_path.c_str(), "r");
+  FILE *fin = ReadAhead::open(full_path);
   if (!fin) {
     ESP_LOGE(TAG, "Keep last N failed, file not found: %s", full_path.c_str());
     return false;
   }
   std::string tmp_path = full_path + ".tmp";
+  if (!this->begin_rewrite(path)) {
+    fclose(fin);
+    return false;
+  }
   FILE *fout = fopen(tmp_path.c_str(), "w");
   if (!fout) {
     fclose(fin);
+    this->end_rewrite();
     ESP_LOGE(TAG, "Keep last N failed, cannot open temp file: %s", tmp_path.c_str());
     return false;
   }
 
+  ReadAhead in(this, fin);
+  setvbuf(fout, nullptr, _IOFBF, this->read_ahead_size_);
   char buf[256];
   int row = 0;
   int skip = total - max_rows;
-  while (fgets(buf, sizeof(buf), fin)) {
+  while (in.gets(buf, sizeof(buf))) {
     if (row >= skip) fputs(buf, fout);
     row++;
   }
-  fclose(fin);
-  fclose(fout);
-  remove(full_path.c_str());
-  rename(tmp_path.c_str(), full_path.c_str());
+  in.close();
+  if (!this->commit_rewrite(fout, full_path, tmp_path, !in.failed())) return false;
 
   ESP_LOGI(TAG, "Trimmed %s to last %d rows (was %d)", full_path.c_str(), max_rows, total);
   return true;
@@ -380,61 +1125,36 @@ bool SdSpiCard::csv_keep_last_n(const char *path, int max_rows) {
 // Pull all columns (rows range) with optional condition on any column
 std::vector<std::vector<std::string>> SdSpiCard::csv_read_rows_range(
     const char *path, int row_start, int row_end, int cond_col_index, const char *condition) {
+  BusGuard guard(this);
 
   std::vector<std::vector<std::string>> out;
-  std::string full_path = std::string(MOUNT_POINT) + path;
-  FILE *f = fopen(full_path.c_str(), "r");
+  std::string full_path = this->mount_point_ + path;
+  FILE *f = ReadAhead::open(full_path);
   if (!f) {
     ESP_LOGE(TAG, "Read rows failed, file not found: %s", full_path.c_str());
     return out;
   }
+  ReadAhead in(this, f);
+  uint32_t start = millis();
 
-  // --- Parse condition like ">5", "<=2.3", "!=0", "=0", "10-20" ---
-  char op[3] = {0};
-  float target = 0.0f, target2 = 0.0f;
-  bool between = false;
-  bool use_condition = (condition != nullptr && strlen(condition) > 0);
-
-  if (use_condition) {
-    if (sscanf(condition, "%f - %f", &target, &target2) == 2 ||
-        sscanf(condition, "%f--%f", &target, &target2) == 2) {
-      between = true;
-    } else if (sscanf(condition, "%2[<>=!]%f", op, &target) < 1) {
-      ESP_LOGW(TAG, "Invalid condition: %s", condition);
-      use_condition = false;
-    }
-  }
+  CsvCondition cond = parse_csv_condition(condition);
+  bool use_condition = cond.enabled;
 
   char buf[256];
   int row = 0;
 
-  while (fgets(buf, sizeof(buf), f)) {
+  while (in.gets(buf, sizeof(buf))) {
     if (row >= row_start && row <= row_end) {
+      strip_record_suffix(buf);
       std::vector<std::string> cols;
-      char *token = strtok(buf, ",");
-      while (token != nullptr) {
-        cols.emplace_back(token);
-        token = strtok(nullptr, ",");
+      size_t len = 0;
+      for (const char *field = csv_next_field(buf, len); field != nullptr; field = csv_next_field(field + len, len)) {
+        cols.emplace_back(field, len);
       }
 
       bool keep = true;
       if (use_condition && cond_col_index < (int)cols.size()) {
-        float val = atof(cols[cond_col_index].c_str());
-        keep = false;
-        if (between)
-          keep = (val >= target && val <= target2);
-        else if (strcmp(op, ">") == 0)
-          keep = (val > target);
-        else if (strcmp(op, "<") == 0)
-          keep = (val < target);
-        else if (strcmp(op, ">=") == 0)
-          keep = (val >= target);
-        else if (strcmp(op, "<=") == 0)
-          keep = (val <= target);
-        else if (strcmp(op, "=") == 0)
-          keep = (val == target);
-        else if (strcmp(op, "!=") == 0)
-          keep = (val != target);
+        keep = csv_condition_keep(cond, atof(cols[cond_col_index].c_str()));
       }
 
        if (keep) out.push_back([&]{ std::vector<std::string> t(cols); t.push_back("@row=" + std::to_string(row)); return t; }());
@@ -442,21 +1162,705 @@ std::vector<std::vector<std::string>> SdSpiCard::csv_read_rows_range(
     }
     if (row > row_end) break;
     row++;
+    guard.tick(strlen(buf), in);
   }
 
-  fclose(f);
-  ESP_LOGI(TAG, "Read rows %d–%d (cond col=%d '%s') → %d rows",
+  in.close();
+  if (in.failed()) ESP_LOGE(TAG, "Read rows of %s cut short by a read error at row %d", full_path.c_str(), row);
+  ESP_LOGI(TAG, "Read rows %d–%d (cond col=%d '%s') → %d rows (%u rows/s scanned)",
            row_start, row_end, cond_col_index,
-           use_condition ? condition : "(none)", (int)out.size());
+           use_condition ? condition : "(none)", (int)out.size(), rows_per_second(row, start));
+  return out;
+}
+
+
+
+
+// --- Chunked export ---
+
+void SdSpiCard::log_export(const char *path, size_t bytes, uint32_t start_ms) {
+  this->last_export_bytes_ = bytes;
+  this->last_export_ms_ = millis() - start_ms;
+  uint32_t ms = this->last_export_ms_ > 0 ? this->last_export_ms_ : 1;
+  ESP_LOGI(TAG, "Exported %u bytes from %s in %u ms (%.1f KB/s)", (unsigned) bytes, path,
+           (unsigned) this->last_export_ms_, bytes / 1.024f / ms);
+}
+
+// Stream [offset, offset + length) of a file into sink. stdio buffering is
+// disabled so FatFs reads whole sectors straight into our chunk buffer.
+bool SdSpiCard::export_file(const char *path, const ExportSink &sink, size_t offset, size_t length,
+                            size_t chunk_size) {
+  std::string full_path = this->mount_point_ + path;
+  std::unique_ptr<ReadAhead> reader;
+  {
+    BusGuard guard(this);
+    if (this->card_ == nullptr) {
+      ESP_LOGW(TAG, "Export skipped: card not mounted");
+      return false;
+    }
+    FILE *f = ReadAhead::open(full_path);
+    if (!f) {
+      ESP_LOGE(TAG, "Export failed, file not found: %s", full_path.c_str());
+      return false;
+    }
+    if (offset > 0 && fseek(f, offset, SEEK_SET) != 0) {
+      fclose(f);
+      ESP_LOGE(TAG, "Export failed, cannot seek to %u in %s", (unsigned) offset, full_path.c_str());
+      return false;
+    }
+    // Each block is read under the bus lock, but the sink (usually a blocking
+    // httpd send) runs with the bus free. Created while the lock is still
+    // held so an unmount in between is noticed on the first read.
+    reader.reset(new ReadAhead(this, f, true, chunk_size));
+  }
+
+  // The sink gets the read-ahead buffers themselves, no extra copy
+  ReadAhead &in = *reader;
+  uint32_t start = millis();
+  size_t sent = 0;
+  bool ok = true;
+  const uint8_t *data;
+  size_t n;
+  while (sent < length && in.next_block(data, n)) {
+    n = std::min(n, length - sent);
+    if (!sink(data, n)) {
+      ESP_LOGW(TAG, "Export of %s aborted by sink after %u bytes", full_path.c_str(), (unsigned) sent);
+      ok = false;
+      break;
+    }
+    sent += n;
+  }
+  in.close();
+  if (ok && in.failed()) {
+    ESP_LOGE(TAG, "Export of %s failed after %u bytes: read error or card removed", full_path.c_str(), (unsigned) sent);
+    ok = false;
+  }
+  this->log_export(path, sent, start);
+  return ok;
+}
+
+// Stream raw CSV lines of rows [row_start, row_end] that pass the optional
+// condition, packing them into chunk_size blocks before calling sink.
+bool SdSpiCard::export_csv_rows(const char *path, int row_start, int row_end, const ExportSink &sink,
+                                int cond_col_index, const char *condition, size_t chunk_size) {
+  std::string full_path = this->mount_point_ + path;
+  std::unique_ptr<ReadAhead> reader;
+  {
+    BusGuard guard(this);
+    if (this->card_ == nullptr) {
+      ESP_LOGW(TAG, "Export skipped: card not mounted");
+      return false;
+    }
+    FILE *f = ReadAhead::open(full_path);
+    if (!f) {
+      ESP_LOGE(TAG, "Export rows failed, file not found: %s", full_path.c_str());
+      return false;
+    }
+    // As in export_file: blocks are read under the lock, parsing and the sink
+    // run without it
+    reader.reset(new ReadAhead(this, f, true));
+  }
+  ReadAhead &in = *reader;
+  CsvCondition cond = parse_csv_condition(condition);
+
+  char line[256];
+  chunk_size = std::max(chunk_size, sizeof(line));
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[chunk_size]);
+  uint32_t start = millis();
+  size_t fill = 0, sent = 0;
+  bool ok = true;
+  int row = 0;
+
+  while (ok && row <= row_end && in.gets(line, sizeof(line))) {
+    if (row >= row_start) {
+      strip_record_suffix(line);
+      float val;
+      bool keep = !cond.enabled || cond_col_index < 0 ||
+                  !csv_column_value(line, cond_col_index, val) || csv_condition_keep(cond, val);
+      if (keep) {
+        size_t len = strlen(line);
+        if (fill + len > chunk_size) {
+          ok = sink(buf.get(), fill);
+          sent += fill;
+          fill = 0;
+        }
+        memcpy(buf.get() + fill, line, len);
+        fill += len;
+      }
+    }
+    row++;
+  }
+  if (ok && fill > 0 && !in.failed()) {
+    ok = sink(buf.get(), fill);
+    sent += fill;
+  }
+  in.close();
+  if (!ok) {
+    ESP_LOGW(TAG, "Export of %s aborted by sink", full_path.c_str());
+  } else if (in.failed()) {
+    ESP_LOGE(TAG, "Export of %s failed after %u bytes: read error or card removed", full_path.c_str(), (unsigned) sent);
+    ok = false;
+  }
+  this->log_export(path, sent, start);
+  return ok;
+}
+
+#ifdef USE_SD_SPI_CARD_HTTP_EXPORT
+static std::string url_decode(const std::string &in) {
+  std::string out;
+  out.reserve(in.size());
+  for (size_t i = 0; i < in.size(); i++) {
+    if (in[i] == '%' && i + 2 < in.size()) {
+      char hex[3] = {in[i + 1], in[i + 2], 0};
+      out += (char) strtol(hex, nullptr, 16);
+      i += 2;
+    } else if (in[i] == '+') {
+      out += ' ';
+    } else {
+      out += in[i];
+    }
+  }
   return out;
 }
 
+static const char *content_type_for(const std::string &path) {
+  size_t dot = path.rfind('.');
+  std::string ext = dot == std::string::npos ? "" : path.substr(dot + 1);
+  if (ext == "csv") return "text/csv";
+  if (ext == "txt" || ext == "log") return "text/plain";
+  if (ext == "json") return "application/json";
+  return "application/octet-stream";
+}
+
+// Response whose status line and headers are held back until the body starts
+struct HttpResponse {
+  httpd_req_t *req;
+  const char *type{"application/octet-stream"};
+  const char *status{nullptr};
+  std::string content_range;  // must stay alive until the first chunk is sent
+  bool accept_ranges{false};
+  bool started{false};
+
+  void begin() {
+    if (this->started) return;
+    this->started = true;
+    httpd_resp_set_type(this->req, this->type);
+    if (this->accept_ranges) httpd_resp_set_hdr(this->req, "Accept-Ranges", "bytes");
+    if (this->status != nullptr) httpd_resp_set_status(this->req, this->status);
+    if (!this->content_range.empty()) httpd_resp_set_hdr(this->req, "Content-Range", this->content_range.c_str());
+  }
+
+  // Once the body has started a failure can only cut it short
+  void finish(bool ok, bool mounted) {
+    if (!ok && !this->started) {
+      if (mounted) {
+        httpd_resp_send_err(this->req, HTTPD_500_INTERNAL_SERVER_ERROR, "Read failed");
+      } else {
+        httpd_resp_set_status(this->req, "503 Service Unavailable");
+        httpd_resp_set_type(this->req, "text/plain");
+        httpd_resp_send(this->req, "Card not mounted", HTTPD_RESP_USE_STRLEN);
+      }
+      return;
+    }
+    this->begin();
+    httpd_resp_send_chunk(this->req, nullptr, 0);
+  }
+};
+
+bool SdSpiCardHttpHandler::canHandle(AsyncWebServerRequest *request) const {
+  if (request->method() != HTTP_GET) return false;
+  std::string url = request->url();
+  return url.size() > this->prefix_.size() + 1 && url.compare(0, this->prefix_.size(), this->prefix_) == 0 &&
+         url[this->prefix_.size()] == '/';
+}
+
+// Runs on the httpd task, so it only reads and never triggers remounts.
+void SdSpiCardHttpHandler::handleRequest(AsyncWebServerRequest *request) {
+  httpd_req_t *req = *request;
+  std::string uri = req->uri;
+  size_t q = uri.find('?');
+  std::string path = url_decode(uri.substr(this->prefix_.size(), q == std::string::npos ? q : q - this->prefix_.size()));
+  if (path.find("..") != std::string::npos) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad path");
+    return;
+  }
+
+  struct stat st;
+  std::string full_path = this->parent_->get_mount_point() + path;
+  this->parent_->lock_bus();
+  int stat_res = stat(full_path.c_str(), &st);
+  this->parent_->unlock_bus();
+  if (stat_res != 0 || S_ISDIR(st.st_mode)) {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Not found");
+    return;
+  }
+
+  // Status and headers go out with the first block, so a failed open or first
+  // read can still be answered with a proper error instead of an empty 200
+  HttpResponse resp{req};
+  auto sink = [&resp](const uint8_t *data, size_t len) {
+    resp.begin();
+    return httpd_resp_send_chunk(resp.req, (const char *) data, len) == ESP_OK;
+  };
+
+  // CSV slice: ?rows=a-b[&col=i&cond=...]
+  char query[128];
+  esp_err_t query_res = httpd_req_get_url_query_str(req, query, sizeof(query));
+  if (query_res == ESP_ERR_HTTPD_RESULT_TRUNC) {
+    httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, "Query too long");
+    return;
+  }
+  if (query_res == ESP_OK) {
+    char val[64];
+    esp_err_t rows_res = httpd_query_key_value(query, "rows", val, sizeof(val));
+    if (rows_res == ESP_OK) {
+      int row_start = 0, row_end = INT32_MAX;
+      if (sscanf(url_decode(val).c_str(), "%d-%d", &row_start, &row_end) < 1) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad rows");
+        return;
+      }
+      int col = -1;
+      std::string cond;
+      esp_err_t col_res = httpd_query_key_value(query, "col", val, sizeof(val));
+      if (col_res == ESP_OK) col = atoi(val);
+      esp_err_t cond_res = httpd_query_key_value(query, "cond", val, sizeof(val));
+      if (cond_res == ESP_OK) cond = url_decode(val);
+      if (col_res == ESP_ERR_HTTPD_RESULT_TRUNC || cond_res == ESP_ERR_HTTPD_RESULT_TRUNC) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Query value too long");
+        return;
+      }
+
+      resp.type = "text/csv";
+      resp.finish(this->parent_->export_csv_rows(path.c_str(), row_start, row_end, sink, col, cond.c_str()),
+                  this->parent_->is_mounted());
+      return;
+    }
+    if (rows_res == ESP_ERR_HTTPD_RESULT_TRUNC) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad rows");
+      return;
+    }
+  }
+
+  // Whole file or a single byte range
+  size_t size = st.st_size;
+  size_t first = 0, last = size > 0 ? size - 1 : 0;
+  bool partial = false;
+  char range[64];
+  if (httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) == ESP_OK &&
+      strncmp(range, "bytes=", 6) == 0) {
+    unsigned long a = 0, b = 0;
+    bool valid = true;
+    if (range[6] == '-') {
+      valid = sscanf(range + 7, "%lu", &b) == 1 && b > 0;
+      first = b >= size ? 0 : size - b;
+    } else {
+      int n = sscanf(range + 6, "%lu-%lu", &a, &b);
+      valid = n >= 1 && (n == 1 || b >= a);
+      first = a;
+      if (n == 2 && b < last) last = b;
+    }
+    if (!valid || first >= size) {
+      std::string content_range = "bytes */" + std::to_string(size);
+      httpd_resp_set_status(req, "416 Range Not Satisfiable");
+      httpd_resp_set_hdr(req, "Content-Range", content_range.c_str());
+      httpd_resp_send(req, nullptr, 0);
+      return;
+    }
+    partial = true;
+  }
+
+  resp.type = content_type_for(path);
+  resp.accept_ranges = true;
+  if (partial) {
+    resp.status = "206 Partial Content";
+    resp.content_range = "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size);
+  }
+  bool ok = size == 0 || this->parent_->export_file(path.c_str(), sink, first, last - first + 1);
+  resp.finish(ok, this->parent_->is_mounted());
+}
+
+void SdSpiCardHttpExport::setup() {
+  this->base_->init();
+  this->base_->add_handler(new SdSpiCardHttpHandler(this->parent_, this->prefix_));
+}
+
+void SdSpiCardHttpExport::dump_config() {
+  ESP_LOGCONFIG(TAG, "SD SPI Card HTTP export:");
+  ESP_LOGCONFIG(TAG, "  URL Prefix: %s/", this->prefix_.c_str());
+  ESP_LOGCONFIG(TAG, "  Mount Point: %s", this->parent_->get_mount_point().c_str());
+}
+#endif
+
+// --- Offline spill queue ---
+
+// Open for appending. A failed open gets the usual unmount + remount and one
+// retry; nullptr with the card still mounted afterwards is a path problem,
+// which the spill queue must not hold on to (it would never replay).
+FILE *SdSpiCard::open_append(const std::string &full_path, const char *reason) {
+  FILE *f = fopen(full_path.c_str(), "a");
+  if (f != nullptr) return f;
+  ESP_LOGE(TAG, "%s failed: %s", reason, full_path.c_str());
+  this->handle_sd_failure(reason);
+  if (this->card_ == nullptr) return nullptr;
+  f = fopen(full_path.c_str(), "a");
+  if (f == nullptr) ESP_LOGE(TAG, "%s failed again after remount, not queued: %s", reason, full_path.c_str());
+  return f;
+}
+
+// Keep an append that could not reach the card. Oldest rows go first when the
+// queue is full. Returns false when spilling is disabled.
+bool SdSpiCard::spill_append(const char *path, const char *line, size_t len) {
+  if (this->spill_max_bytes_ == 0) return false;
+  size_t cost = strlen(path) + len + SPILL_ENTRY_OVERHEAD;
+  if (cost > this->spill_max_bytes_) {
+    this->spill_dropped_++;
+    return false;
+  }
+  while (!this->spill_.empty() &&
+         (this->spill_bytes_ + cost > this->spill_max_bytes_ ||
+          (this->spill_persist_slots_ > 0 && this->spill_tail_ - this->spill_head_ >= this->spill_persist_slots_))) {
+    this->spill_drop_oldest();
+  }
+  this->spill_.push_back({path, std::string(line, len), false});
+  this->spill_bytes_ += cost;
+  this->spill_queued_++;
+  this->spill_persist_push(this->spill_.back());
+  ESP_LOGW(TAG, "Card absent, queued row for %s (%u rows pending)", path, (unsigned) this->spill_.size());
+
+  // Nothing else remounts the card while rows are being queued
+  if (millis() - this->last_remount_ms_ >= SPILL_REMOUNT_INTERVAL_MS) this->try_remount();
+  return true;
+}
+
+void SdSpiCard::spill_drop_oldest() {
+  const SpillEntry &e = this->spill_.front();
+  bool persisted = e.persisted;
+  this->spill_bytes_ -= e.path.size() + e.line.size() + SPILL_ENTRY_OVERHEAD;
+  this->spill_.pop_front();
+  this->spill_dropped_++;
+  // Rows too long for NVS never took a slot, so only persisted ones move head
+  if (persisted) this->spill_persist_pop(1);
+}
+
+// Write everything queued, one batched append per file, in original row order
+void SdSpiCard::replay_spill_queue() {
+  if (this->spill_.empty() || this->card_ == nullptr) return;
+  BusGuard guard(this);
+  uint32_t start = millis();
+
+  std::vector<std::string> paths;
+  for (auto &e : this->spill_) {
+    if (std::find(paths.begin(), paths.end(), e.path) == paths.end()) paths.push_back(e.path);
+  }
+
+  size_t replayed = 0;
+  std::vector<std::string> failed;
+  for (auto &path : paths) {
+    std::string batch;
+    size_t rows = 0;
+    for (auto &e : this->spill_) {
+      if (e.path != path) continue;
+      char suffix[RECORD_SUFFIX_LEN + 1];
+      batch += e.line;
+      batch.append(suffix, this->record_suffix(e.line.data(), e.line.size(), suffix));
+      batch += '\n';
+      rows++;
+    }
+    this->invalidate_dir_cache(path.c_str());
+    std::string full_path = this->mount_point_ + path;
+    FILE *f = fopen(full_path.c_str(), "a");
+    // No handle_sd_failure here: we are called from the mount path
+    if (!f || fwrite(batch.data(), 1, batch.size(), f) != batch.size()) {
+      if (f) fclose(f);
+      ESP_LOGE(TAG, "Spill replay failed for %s, keeping %u rows", full_path.c_str(), (unsigned) rows);
+      failed.push_back(path);
+      continue;
+    }
+    fclose(f);
+    this->note_appended(path.c_str());
+    replayed += rows;
+  }
+
+  // Keep only rows whose file could not be written
+  std::deque<SpillEntry> kept;
+  size_t kept_bytes = 0;
+  for (auto &e : this->spill_) {
+    if (std::find(failed.begin(), failed.end(), e.path) == failed.end()) continue;
+    kept_bytes += e.path.size() + e.line.size() + SPILL_ENTRY_OVERHEAD;
+    kept.push_back(std::move(e));
+  }
+  this->spill_.swap(kept);
+  this->spill_bytes_ = kept_bytes;
+  this->spill_replayed_ += replayed;
+  this->spill_persist_rewrite();
+
+  ESP_LOGI(TAG, "Replayed %u spilled rows into %u files in %u ms", (unsigned) replayed,
+           (unsigned) (paths.size() - failed.size()), (unsigned) (millis() - start));
+}
+
+// NVS mirror: entries live in slots "e<seq % slots>", seq running from head to tail.
+// Each card gets its own namespace, keyed by its (unique) mount point.
+void SdSpiCard::spill_persist_load() {
+  if (this->spill_persist_slots_ == 0) return;
+  char ns[16];
+  snprintf(ns, sizeof(ns), "sdsp%08x", (unsigned) fnv1_hash(this->mount_point_));
+  if (nvs_open(ns, NVS_READWRITE, &this->spill_nvs_) != ESP_OK) {
+    ESP_LOGE(TAG, "Spill queue: cannot open NVS, persistence disabled");
+    this->spill_persist_slots_ = 0;
+    return;
+  }
+  nvs_get_u32(this->spill_nvs_, "head", &this->spill_head_);
+  nvs_get_u32(this->spill_nvs_, "tail", &this->spill_tail_);
+  // Slots are addressed by seq % slots, so read with the layout they were written in
+  uint32_t slots = this->spill_persist_slots_;
+  bool stored = nvs_get_u32(this->spill_nvs_, "slots", &slots) == ESP_OK && slots > 0;
+  if (!stored) slots = this->spill_persist_slots_;
+  // Keep the newest rows that fit both the old and the configured ring
+  uint32_t keep = std::min<uint32_t>(slots, this->spill_persist_slots_);
+  if (this->spill_tail_ - this->spill_head_ > keep) this->spill_head_ = this->spill_tail_ - keep;
+
+  char key[8];
+  char blob[SPILL_BLOB_MAX];
+  for (uint32_t seq = this->spill_head_; seq != this->spill_tail_; seq++) {
+    snprintf(key, sizeof(key), "e%u", (unsigned) (seq % slots));
+    size_t len = sizeof(blob);
+    if (nvs_get_blob(this->spill_nvs_, key, blob, &len) != ESP_OK) continue;
+    size_t path_len = strnlen(blob, len);
+    if (path_len >= len) continue;
+    this->spill_.push_back({std::string(blob, path_len), std::string(blob + path_len + 1, len - path_len - 1), true});
+    this->spill_bytes_ += len + SPILL_ENTRY_OVERHEAD - 1;
+  }
+
+  if (!stored || slots != this->spill_persist_slots_) {
+    nvs_set_u32(this->spill_nvs_, "slots", this->spill_persist_slots_);
+    if (stored) {
+      ESP_LOGI(TAG, "Spill queue: persist_slots changed %u -> %u, re-laying out NVS", (unsigned) slots,
+               (unsigned) this->spill_persist_slots_);
+      this->spill_persist_rewrite();  // commits "slots" together with the new head
+    } else {
+      nvs_commit(this->spill_nvs_);
+    }
+  }
+  if (!this->spill_.empty()) ESP_LOGI(TAG, "Spill queue: %u rows restored from NVS", (unsigned) this->spill_.size());
+}
+
+void SdSpiCard::spill_persist_push(SpillEntry &e) {
+  if (this->spill_persist_slots_ == 0) return;
+  char blob[SPILL_BLOB_MAX];
+  size_t len = e.path.size() + 1 + e.line.size();
+  if (len > sizeof(blob)) {
+    ESP_LOGW(TAG, "Spill queue: row too long for NVS, kept in RAM only");
+    return;
+  }
+  memcpy(blob, e.path.c_str(), e.path.size() + 1);
+  memcpy(blob + e.path.size() + 1, e.line.data(), e.line.size());
+  char key[8];
+  snprintf(key, sizeof(key), "e%u", (unsigned) (this->spill_tail_ % this->spill_persist_slots_));
+  nvs_set_blob(this->spill_nvs_, key, blob, len);
+  this->spill_tail_++;
+  nvs_set_u32(this->spill_nvs_, "tail", this->spill_tail_);
+  nvs_commit(this->spill_nvs_);
+  e.persisted = true;
+}
+
+void SdSpiCard::spill_persist_pop(size_t count) {
+  if (this->spill_persist_slots_ == 0) return;
+  this->spill_head_ += count;
+  nvs_set_u32(this->spill_nvs_, "head", this->spill_head_);
+  nvs_commit(this->spill_nvs_);
+}
+
+// After a replay only failed rows remain; write them back from a fresh head
+void SdSpiCard::spill_persist_rewrite() {
+  if (this->spill_persist_slots_ == 0) return;
+  this->spill_head_ = this->spill_tail_;
+  nvs_set_u32(this->spill_nvs_, "head", this->spill_head_);
+  nvs_commit(this->spill_nvs_);
+  for (auto &e : this->spill_) {
+    e.persisted = false;
+    this->spill_persist_push(e);
+  }
+}
+
+// --- Record integrity & crash recovery ---
 
+size_t SdSpiCard::record_suffix(const char *line, size_t len, char *out) const {
+  if (!this->checksums_) return 0;
+  snprintf(out, RECORD_SUFFIX_LEN + 1, ",*%04X", crc16(line, len));
+  return RECORD_SUFFIX_LEN;
+}
 
+// One record = line [+ checksum] + '\n'; the newline is the commit marker
+void SdSpiCard::write_record(FILE *f, const char *line, size_t len) {
+  char suffix[RECORD_SUFFIX_LEN + 1];
+  fwrite(line, 1, len, f);
+  fwrite(suffix, 1, this->record_suffix(line, len, suffix), f);
+  fputc('\n', f);
+}
+
+// Remember files appended to since boot so a remount checks their tails too
+void SdSpiCard::note_appended(const char *path) {
+  for (auto &p : this->appended_files_) {
+    if (p == path) return;
+  }
+  if (this->appended_files_.size() < MAX_TRACKED_FILES) this->appended_files_.push_back(path);
+}
+
+// Journal the rewrite target before its .tmp exists, so a power cut at any
+// point leaves nothing the next mount cannot clean up. No journal, no rewrite.
+bool SdSpiCard::begin_rewrite(const char *path) {
+  std::string journal = this->mount_point_ + JOURNAL_PATH;
+  FILE *j = fopen(journal.c_str(), "w");
+  if (!j) {
+    ESP_LOGE(TAG, "Cannot write rewrite journal for %s, not rewriting", path);
+    return false;
+  }
+  fputs(path, j);
+  bool ok = fflush(j) == 0 && fsync(fileno(j)) == 0;
+  ok = (fclose(j) == 0) && ok;
+  if (!ok) {
+    ESP_LOGE(TAG, "Cannot write rewrite journal for %s, not rewriting", path);
+    this->end_rewrite();
+  }
+  return ok;
+}
+
+void SdSpiCard::end_rewrite() { remove((this->mount_point_ + JOURNAL_PATH).c_str()); }
+
+// Make .tmp durable, then swap it in. On a read error of the original
+// (source_ok false) or any write error, the original stays.
+bool SdSpiCard::commit_rewrite(FILE *fout, const std::string &full_path, const std::string &tmp_path,
+                               bool source_ok) {
+  bool ok = !ferror(fout) && fflush(fout) == 0 && fsync(fileno(fout)) == 0;
+  ok = (fclose(fout) == 0) && ok;
+  if (!source_ok || !ok) {
+    ESP_LOGE(TAG, "Rewrite of %s failed (%s error), keeping original", full_path.c_str(),
+             source_ok ? "write" : "read");
+    remove(tmp_path.c_str());
+    this->end_rewrite();
+    return false;
+  }
+  remove(full_path.c_str());
+  if (rename(tmp_path.c_str(), full_path.c_str()) != 0) {
+    // Journal stays, next mount finishes the rename
+    ESP_LOGE(TAG, "Rename %s failed", tmp_path.c_str());
+    return false;
+  }
+  this->end_rewrite();
+  return true;
+}
+
+// Cut a torn tail: everything after the last complete (and, with checksums,
+// valid) record within the last tail_window bytes. Returns bytes removed.
+size_t SdSpiCard::recover_tail(const std::string &path) {
+  std::string full_path = this->mount_point_ + path;
+  FILE *f = fopen(full_path.c_str(), "rb");
+  if (!f) return 0;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  if (size <= 0) {
+    fclose(f);
+    return 0;
+  }
+  size_t window = std::min((size_t) size, this->recovery_tail_window_);
+  std::unique_ptr<char[]> buf(new char[window]);
+  fseek(f, size - window, SEEK_SET);
+  size_t n = fread(buf.get(), 1, window, f);
+  fclose(f);
+  if (n != window) return 0;
+
+  bool whole_file = window == (size_t) size;
+  size_t end = window;
+  size_t keep = SIZE_MAX;
+  while (end > 0) {
+    size_t nl = end;
+    while (nl > 0 && buf[nl - 1] != '\n') nl--;
+    if (nl == 0) break;  // no complete record left in the window
+    size_t line_end = nl;
+    size_t line_start = line_end - 1;
+    while (line_start > 0 && buf[line_start - 1] != '\n') line_start--;
+    // A record cut by the window edge cannot be checked; trust it
+    if (!this->checksums_ || (line_start == 0 && !whole_file) ||
+        record_valid(buf.get() + line_start, line_end - 1 - line_start)) {
+      keep = line_end;
+      break;
+    }
+    end = line_start;
+  }
+  if (keep == SIZE_MAX) {
+    // Nothing to cut back to (e.g. a small file never written line by line):
+    // emptying it would lose more than the torn tail
+    ESP_LOGW(TAG, "Recovery: no intact record in %s%u bytes of %s, left as is", whole_file ? "all " : "last ",
+             (unsigned) window, path.c_str());
+    return 0;
+  }
+
+  size_t cut = window - keep;
+  if (cut == 0) return 0;
+  if (truncate(full_path.c_str(), size - cut) != 0) {
+    ESP_LOGE(TAG, "Recovery: truncate of %s failed", path.c_str());
+    return 0;
+  }
+  ESP_LOGW(TAG, "Recovery: cut %u torn bytes from %s", (unsigned) cut, path.c_str());
+  return cut;
+}
+
+// Finish or roll back an interrupted .tmp rewrite of path
+void SdSpiCard::recover_rewrite(const std::string &path) {
+  std::string full_path = this->mount_point_ + path;
+  std::string tmp_path = full_path + ".tmp";
+  struct stat st;
+  if (stat(tmp_path.c_str(), &st) != 0) return;
+  if (stat(full_path.c_str(), &st) == 0) {
+    // Original never removed, so it is intact; the .tmp may be partial
+    remove(tmp_path.c_str());
+    ESP_LOGW(TAG, "Recovery: discarded unfinished %s.tmp", path.c_str());
+  } else {
+    // Original already removed, .tmp was synced before that
+    rename(tmp_path.c_str(), full_path.c_str());
+    ESP_LOGW(TAG, "Recovery: restored %s from .tmp", path.c_str());
+  }
+}
+
+// Runs on every mount. Only the journal, the tails of known log files and
+// their .tmp siblings are read, so the cost does not grow with file size.
+void SdSpiCard::recover() {
+  BusGuard guard(this);
+  uint32_t start = millis();
+  size_t cut = 0, checked = 0;
+
+  std::string journal = this->mount_point_ + JOURNAL_PATH;
+  FILE *j = fopen(journal.c_str(), "r");
+  if (j) {
+    char path[128] = {0};
+    if (fgets(path, sizeof(path), j) != nullptr && path[0] == '/') this->recover_rewrite(path);
+    fclose(j);
+    remove(journal.c_str());
+  }
+
+  std::vector<std::string> files = this->recovery_files_;
+  for (auto &p : this->appended_files_) {
+    if (std::find(files.begin(), files.end(), p) == files.end()) files.push_back(p);
+  }
+  for (auto &p : files) {
+    this->recover_rewrite(p);
+    cut += this->recover_tail(p);
+    checked++;
+  }
+  this->invalidate_dir_cache(nullptr);
+
+  this->last_recovery_ms_ = millis() - start;
+  ESP_LOGI(TAG, "Recovery pass: %u files checked, %u bytes cut in %u ms", (unsigned) checked, (unsigned) cut,
+           (unsigned) this->last_recovery_ms_);
+#ifdef USE_SENSOR
+  if (this->recovery_time_sensor_ != nullptr) this->recovery_time_sensor_->publish_state(this->last_recovery_ms_);
+#endif
+}
 
 // check sd card presence , if failed try to create , if failed mark the card as failed
 bool SdSpiCard::check_kappa() {
 #ifdef USE_ESP_IDF
+  BusGuard guard(this);
   if (this->card_ == nullptr) {
     ESP_LOGW(TAG, "Kappa check skipped: card not mounted");
     return false;
@@ -484,12 +1888,15 @@ bool SdSpiCard::check_kappa() {
 
 
 void SdSpiCard::handle_sd_failure(const char *reason) {
+  BusGuard guard(this);
   ESP_LOGE(TAG, "SD card failure detected: %s → unmounting...", reason);
 
   // --- Step 1: Unmount card if still mounted ---
   if (this->card_ != nullptr) {
-    esp_vfs_fat_sdcard_unmount(MOUNT_POINT, this->card_);
+    esp_vfs_fat_sdcard_unmount(this->mount_point_.c_str(), this->card_);
     this->card_ = nullptr;
+    this->mount_id_++;
+    this->invalidate_dir_cache(nullptr);
     
     // Invalidate sensor values
         if (this->total_space_sensor_ != nullptr)
@@ -522,28 +1929,20 @@ void SdSpiCard::handle_sd_failure(const char *reason) {
   this->try_remount();
 }
 
-//mount card while running 
-void SdSpiCard::try_remount() {
+// mount card on the configured host; bus must already be up
+void SdSpiCard::mount_card() {
 #ifdef USE_ESP_IDF
-  if (this->card_ != nullptr) return;
-  
-    // Guard: skip if pins not ready yet
-  if (!this->cs_pin_ || !this->clk_pin_ || !this->mosi_pin_ || !this->miso_pin_) {
-    ESP_LOGW("sd_spi_card", "Pins not initialized yet — skipping remount");
-    return;
-  }
-
-  ESP_LOGI(TAG, "Attempting to re-mount SD card...");
+  BusGuard guard(this);
 
   sdmmc_host_t host = SDSPI_HOST_DEFAULT();
-  host.slot = VSPI_HOST;
+  host.slot = this->spi_host_;
   host.max_freq_khz = this->spi_freq_khz_;
 
   int cs = static_cast<InternalGPIOPin*>(this->cs_pin_)->get_pin();
 
   sdspi_device_config_t slot_config = SDSPI_DEVICE_CONFIG_DEFAULT();
   slot_config.gpio_cs = (gpio_num_t) cs;
-  slot_config.host_id = (spi_host_device_t) host.slot;
+  slot_config.host_id = this->spi_host_;
 
   esp_vfs_fat_sdmmc_mount_config_t mount_config = {
       .format_if_mount_failed = false,
@@ -551,13 +1950,38 @@ void SdSpiCard::try_remount() {
       .allocation_unit_size = 16 * 1024
   };
 
-  esp_err_t ret = esp_vfs_fat_sdspi_mount(MOUNT_POINT, &host, &slot_config, &mount_config, &this->card_);
-  //bool mounted = (ret == ESP_OK);
+  esp_err_t ret = esp_vfs_fat_sdspi_mount(this->mount_point_.c_str(), &host, &slot_config, &mount_config, &this->card_);
   if (ret != ESP_OK) {
     ESP_LOGE(TAG, "Failed to mount SD card: %s", esp_err_to_name(ret));
     this->card_ = nullptr;
   } else {
-    ESP_LOGI(TAG, "SD card mounted at %s (freq=%d kHz)", MOUNT_POINT, this->spi_freq_khz_);
+    snprintf(this->fatfs_drive_, sizeof(this->fatfs_drive_), "%u:", ff_diskio_get_pdrv_card(this->card_));
+    this->mount_id_++;
+    this->invalidate_dir_cache(nullptr);
+    ESP_LOGI(TAG, "SD card mounted at %s (host=%d, freq=%d kHz)", this->mount_point_.c_str(), (int) this->spi_host_,
+             this->spi_freq_khz_);
+    this->recover();
+    this->replay_spill_queue();
+  }
+#endif
+}
+
+//mount card while running 
+void SdSpiCard::try_remount() {
+#ifdef USE_ESP_IDF
+  if (this->card_ != nullptr) return;
+  
+    // Guard: skip if pins not ready yet
+  if (!this->cs_pin_ || this->bus_lock_ == nullptr) {
+    ESP_LOGW("sd_spi_card", "Pins not initialized yet — skipping remount");
+    return;
+  }
+
+  ESP_LOGI(TAG, "Attempting to re-mount SD card...");
+  this->last_remount_ms_ = millis();
+  this->mount_card();
+
+  if (this->card_ != nullptr) {
   #ifdef USE_BINARY_SENSOR
   if (this->card_status_binary_sensor_ != nullptr) {
     bool mounted = (this->card_ != nullptr);
@@ -5,11 +5,21 @@
 #include "esphome/core/defines.h"
 #include <vector>
 #include <string>
+#include <ctime>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <deque>
 
 #ifdef USE_ESP_IDF
 #include "driver/sdspi_host.h"
+#include "soc/soc_caps.h"
 #include "esp_vfs_fat.h"
+#include "ff.h"
 #include "sdmmc_cmd.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
 #endif
 
 #ifdef USE_SENSOR
@@ -24,6 +34,10 @@
 #include "esphome/components/text_sensor/text_sensor.h"
 #endif
 
+#ifdef USE_SD_SPI_CARD_HTTP_EXPORT
+#include "esphome/components/web_server_base/web_server_base.h"
+#endif
+
 namespace esphome {
 namespace sd_spi_card {
 
@@ -38,19 +52,108 @@ struct FileSizeSensor {
 };
 #endif
 
+// Single directory entry. size and mtime come straight from the FAT directory
+// entry, so listing never opens the files themselves.
 struct FileInfo {
   std::string path;
   size_t size;
   bool is_directory;
+  time_t mtime;
+
+  FileInfo(std::string const &, size_t, bool, time_t);
+};
+
+// Resumable position of a paged directory walk. Create one with
+// SdSpiCard::list_directory_begin() and keep passing it to
+// list_directory_page() until done is true. One open directory per level is
+// kept, so each page costs only its own entries and the cursor stays small no
+// matter how many files the card holds.
+struct DirCursor {
+  struct Frame {
+    std::string dir;
+    uint16_t next_index;
+    uint8_t depth;
+#ifdef USE_ESP_IDF
+    // Left open between pages while the mount it came from is alive. Cursors
+    // are copied and may be dropped unfinished, which FatFs only tolerates
+    // while it keeps no open-object table (asserted below).
+    FF_DIR handle{};
+    uint32_t mount_id{0};  // 0 = not open
+#endif
+  };
+#ifdef USE_ESP_IDF
+  static_assert(FF_FS_LOCK == 0, "DirCursor keeps FF_DIR handles open; needs CONFIG_FATFS_FS_LOCK=0");
+#endif
+
+  std::string root;
+  std::string pattern;            // glob on the file name ("*.csv", "seg_??.log"), empty = all
+  uint8_t max_depth{0};           // 0 = only root, 1 = root + direct subdirs, ...
+  size_t page_size{16};
+  bool include_directories{true};
+  bool done{false};
+  std::vector<Frame> stack;
+};
+
+// Optional per-record checksum appended as an extra column: ",*HHHH"
+static const size_t RECORD_SUFFIX_LEN = 6;
+
+// Line buffer for typed CSV rows, formatted without touching the heap. The
+// limit matches the 256-byte fgets buffer the CSV readers use.
+struct CsvLine {
+  static const size_t MAX_LEN = 248;  // + checksum + '\n' + '\0' still fits the readers
+  char buf[MAX_LEN];
+  size_t len{0};
+  uint8_t cells{0};
+  bool overflow{false};
+  bool invalid{false};  // a text cell held ',' or a line break; the row would split
+
+  CsvLine &next_cell() {
+    if (cells++ > 0) append(",", 1);
+    return *this;
+  }
+  void append(const char *s, size_t n);
+  void append(const char *s) { append(s, strlen(s)); }
+  // Free text for one cell. The readers do not understand quoting, so text
+  // that would split the row is refused (invalid) rather than escaped.
+  void append_text(const char *s, size_t n);
+  void append_text(const char *s) { append_text(s, strlen(s)); }
+  void append_int(int64_t v);
+  void append_fixed(float v, uint8_t decimals);
+  void append_time(time_t t);
+};
+
+// Float column with a fixed number of decimals, e.g. CsvFixed<1>(temp)
+template<uint8_t Decimals> struct CsvFixed {
+  float value;
+  CsvFixed(float v) : value(v) {}
+};
 
-  FileInfo(std::string const &, size_t, bool);
+// Local time column, written as "YYYY-MM-DD HH:MM:SS"
+struct CsvTimestamp {
+  time_t value;
+  CsvTimestamp(time_t v) : value(v) {}
 };
 
+template<typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+inline void csv_cell(CsvLine &line, T v) { line.append_int(v); }
+inline void csv_cell(CsvLine &line, float v) { line.append_fixed(v, 2); }
+inline void csv_cell(CsvLine &line, double v) { line.append_fixed(v, 2); }
+template<uint8_t D> inline void csv_cell(CsvLine &line, CsvFixed<D> v) { line.append_fixed(v.value, D); }
+inline void csv_cell(CsvLine &line, CsvTimestamp v) { line.append_time(v.value); }
+inline void csv_cell(CsvLine &line, const char *v) { line.append_text(v); }
+inline void csv_cell(CsvLine &line, const std::string &v) { line.append_text(v.c_str(), v.size()); }
+
+struct ReadAheadPool;
+
 class SdSpiCard : public PollingComponent {
  #ifdef USE_SENSOR
   SUB_SENSOR(used_space)
   SUB_SENSOR(total_space)
   SUB_SENSOR(free_space)
+  SUB_SENSOR(spill_queued)
+  SUB_SENSOR(spill_replayed)
+  SUB_SENSOR(spill_dropped)
+  SUB_SENSOR(recovery_time)
 #endif
  
  public:
@@ -64,9 +167,84 @@ class SdSpiCard : public PollingComponent {
   void set_mosi_pin(GPIOPin *pin) { mosi_pin_ = pin; }
   void set_miso_pin(GPIOPin *pin) { miso_pin_ = pin; }
   void set_spi_freq(int freq) { spi_freq_khz_ = freq; }
+  void set_spi_host(spi_host_device_t host) { spi_host_ = host; }
+  void set_mount_point(const std::string &mount_point) { mount_point_ = mount_point; }
+  void set_burst_size(size_t burst_size) { burst_size_ = burst_size; }
+  // Sequential reads keep `count` buffers of `size` bytes in flight (1 = no read-ahead)
+  void set_read_ahead(size_t count, size_t size) {
+    read_ahead_count_ = count;
+    read_ahead_size_ = size;
+  }
+  const std::string &get_mount_point() const { return mount_point_; }
+  size_t get_burst_size() const { return burst_size_; }
+  uint32_t get_mount_id() const { return mount_id_; }
+  bool is_mounted() const { return card_ != nullptr; }
+  // Read-ahead buffers and helper task, made on first use under the bus lock
+  ReadAheadPool *read_ahead_pool();
+
+  // Per-host lock shared by all cards on the bus. Lambdas can hold it to keep
+  // card traffic out of a critical transfer on another device.
+  void lock_bus();
+  void unlock_bus();
+  // false if the card was unmounted meanwhile: files opened before are dead
+  bool yield_bus();
+
+  // Appends made while the card is absent are queued (max_bytes, 0 = off) and
+  // written back on the next successful mount. persist_slots > 0 mirrors the
+  // queue into an NVS ring so it also survives a reboot.
+  void set_spill_queue(size_t max_bytes, size_t persist_slots) {
+    spill_max_bytes_ = max_bytes;
+    spill_persist_slots_ = persist_slots;
+  }
+  size_t get_spill_pending() const { return spill_.size(); }
+  uint32_t get_spill_queued() const { return spill_queued_; }
+  uint32_t get_spill_replayed() const { return spill_replayed_; }
+  uint32_t get_spill_dropped() const { return spill_dropped_; }
+  void replay_spill_queue();
+
+  // Appended records (append_file and the csv_append* calls, not write_file)
+  // get a ",*HHHH" CRC-16 column; the mount-time recovery pass then also
+  // drops records whose checksum does not match. Row readers and row exports
+  // leave the column out; byte exports (export_file, HTTP whole-file and Range
+  // downloads) send the file as stored, column included.
+  void set_checksums(bool checksums) { checksums_ = checksums; }
+  // Log files whose tails are checked on every mount (besides files appended since boot)
+  void add_recovery_file(const std::string &path) { recovery_files_.push_back(path); }
+  void set_recovery_tail_window(size_t window) { recovery_tail_window_ = window; }
+  uint32_t get_last_recovery_ms() const { return last_recovery_ms_; }
+  void recover();
  
   size_t file_size(const char *path);
+
+  // --- Directory listing (paged, resumable) ---
+  DirCursor list_directory_begin(const char *path, uint8_t max_depth = 0, const char *pattern = "",
+                                 size_t page_size = 16, bool include_directories = true);
+  size_t list_directory_page(DirCursor &cursor, std::vector<FileInfo> &page);
+
+  // --- Chunked export ---
+  // Data is handed to sink one chunk at a time; sink returns false to abort.
+  using ExportSink = std::function<bool(const uint8_t *data, size_t len)>;
+  static const size_t EXPORT_CHUNK_SIZE = 4096;
+  bool export_file(const char *path, const ExportSink &sink, size_t offset = 0, size_t length = SIZE_MAX,
+                   size_t chunk_size = EXPORT_CHUNK_SIZE);
+  bool export_csv_rows(const char *path, int row_start, int row_end, const ExportSink &sink,
+                       int cond_col_index = -1, const char *condition = "", size_t chunk_size = EXPORT_CHUNK_SIZE);
+  uint32_t get_last_export_bytes() const { return last_export_bytes_; }
+  uint32_t get_last_export_ms() const { return last_export_ms_; }
+
   
+  // --- CSV Helpers (typed, heap free) ---
+  // csv_append("/log.csv", uptime, CsvFixed<1>(temp), CsvTimestamp(now));
+  // csv_append<3>(...) additionally fails to compile unless exactly 3 cells are given.
+  template<size_t Columns = 0, typename... Ts> bool csv_append(const char *path, const Ts &...cells) {
+    static_assert(sizeof...(Ts) > 0, "csv_append needs at least one cell");
+    static_assert(Columns == 0 || Columns == sizeof...(Ts), "csv_append: cell count does not match column count");
+    CsvLine line;
+    (csv_cell(line.next_cell(), cells), ...);
+    return this->csv_append_line(path, line);
+  }
+  bool csv_append_line(const char *path, const CsvLine &line);
+
   // --- CSV Helpers (vector based) ---
   bool csv_append_row(const char *path, const std::vector<std::string> &cells);
   int  csv_row_count(const char *path);
@@ -103,17 +281,180 @@ class SdSpiCard : public PollingComponent {
   GPIOPin *mosi_pin_{nullptr};
   GPIOPin *miso_pin_{nullptr};
   int spi_freq_khz_{1000};   // default 1 MHz
+#if SOC_SPI_PERIPH_NUM > 2
+  spi_host_device_t spi_host_{SPI3_HOST};
+#else
+  spi_host_device_t spi_host_{SPI2_HOST};  // C3/C6/H2 have no SPI3
+#endif
+  bool owns_bus_{false};
+  std::string mount_point_{"/sdcard"};
+  size_t burst_size_{16 * 1024};
+  size_t read_ahead_count_{2};
+  size_t read_ahead_size_{4096};
+  ReadAheadPool *read_ahead_pool_{nullptr};
+  SemaphoreHandle_t bus_lock_{nullptr};
+  int bus_lock_depth_{0};
   esp_err_t last_sd_error_ = ESP_OK;
+  char fatfs_drive_[4] = "0:";
+  uint32_t mount_id_{0};  // bumped on every mount and unmount
+  uint32_t last_export_bytes_{0};
+  uint32_t last_export_ms_{0};
+  void log_export(const char *path, size_t bytes, uint32_t start_ms);
+
+  struct SpillEntry {
+    std::string path;
+    std::string line;
+    bool persisted;  // holds an NVS slot (rows too long for a slot stay RAM-only)
+  };
+  static const size_t SPILL_ENTRY_OVERHEAD = 48;  // rough per-row heap cost on top of the text
+  static const size_t SPILL_BLOB_MAX = 320;
+  static const uint32_t SPILL_REMOUNT_INTERVAL_MS = 5000;
+  std::deque<SpillEntry> spill_{};
+  size_t spill_bytes_{0};
+  size_t spill_max_bytes_{0};
+  size_t spill_persist_slots_{0};
+  uint32_t spill_queued_{0};
+  uint32_t spill_replayed_{0};
+  uint32_t spill_dropped_{0};
+  nvs_handle_t spill_nvs_{0};
+  uint32_t spill_head_{0};
+  uint32_t spill_tail_{0};
+  uint32_t last_remount_ms_{0};
+  FILE *open_append(const std::string &full_path, const char *reason);
+  bool spill_append(const char *path, const char *line, size_t len);
+  void spill_drop_oldest();
+  void spill_persist_load();
+  void spill_persist_push(SpillEntry &e);
+  void spill_persist_pop(size_t count);
+  void spill_persist_rewrite();
+
+  static const size_t MAX_TRACKED_FILES = 16;
+  bool checksums_{false};
+  std::vector<std::string> recovery_files_{};
+  std::vector<std::string> appended_files_{};
+  size_t recovery_tail_window_{4096};
+  uint32_t last_recovery_ms_{0};
+  size_t record_suffix(const char *line, size_t len, char *out) const;
+  void write_record(FILE *f, const char *line, size_t len);
+  void note_appended(const char *path);
+  bool begin_rewrite(const char *path);
+  void end_rewrite();
+  bool commit_rewrite(FILE *fout, const std::string &full_path, const std::string &tmp_path, bool source_ok);
+  size_t recover_tail(const std::string &path);
+  void recover_rewrite(const std::string &path);
+
   
   
  #ifdef USE_SENSOR
   std::vector<FileSizeSensor> file_size_sensors_{};
  #endif
   void update_sensors();
-  std::vector<FileInfo> &list_directory_file_info_rec(const char *path, uint8_t depth, std::vector<FileInfo> &list);
+
+  // Recently listed pages, keyed by cursor state. Dropped on our own writes/deletes.
+  struct DirCacheEntry {
+    std::string key;
+    std::string root;
+    std::vector<FileInfo> page;
+    DirCursor next;
+  };
+  static const size_t DIR_CACHE_SIZE = 4;
+  std::vector<DirCacheEntry> dir_cache_{};
+  size_t dir_cache_next_{0};
+  std::string fatfs_path(const std::string &path) const;
+  void invalidate_dir_cache(const char *path);
   static std::string error_code_to_string();
   
 };
 
+// Fixed column layout bound to one file:
+//   CsvSchema<uint32_t, CsvFixed<2>, CsvTimestamp> log(id(sd_1), "/log.csv");
+//   log.append(uptime, temp, now);
+template<typename... Cols> class CsvSchema {
+ public:
+  static constexpr size_t COLUMNS = sizeof...(Cols);
+  CsvSchema(SdSpiCard *card, const char *path) : card_(card), path_(path) {}
+  bool append(Cols... cells) { return card_->csv_append<COLUMNS>(path_, cells...); }
+
+ protected:
+  SdSpiCard *card_;
+  const char *path_;
+};
+
+// sd_spi_card.csv_append action; each column formats itself into the line
+// Constant paths and text cells are kept as the literals codegen emits, so
+// play() only touches the heap for lambda paths and lambda string cells.
+template<typename... Ts> class CsvAppendAction : public Action<Ts...>, public Parented<SdSpiCard> {
+ public:
+  TEMPLATABLE_VALUE(std::string, path)
+  void set_static_path(const char *path) { static_path_ = path; }
+
+  void add_int_column(TemplatableValue<int64_t, Ts...> v) {
+    columns_.push_back([v](CsvLine &line, Ts... x) mutable { line.append_int(v.value(x...)); });
+  }
+  void add_float_column(TemplatableValue<float, Ts...> v, uint8_t decimals) {
+    columns_.push_back([v, decimals](CsvLine &line, Ts... x) mutable { line.append_fixed(v.value(x...), decimals); });
+  }
+  void add_timestamp_column(TemplatableValue<int64_t, Ts...> v) {
+    columns_.push_back([v](CsvLine &line, Ts... x) mutable { line.append_time((time_t) v.value(x...)); });
+  }
+  void add_now_column() {
+    columns_.push_back([](CsvLine &line, Ts... x) { line.append_time(::time(nullptr)); });
+  }
+  void add_string_column(TemplatableValue<std::string, Ts...> v) {
+    columns_.push_back([v](CsvLine &line, Ts... x) mutable {
+      std::string text = v.value(x...);
+      line.append_text(text.c_str(), text.size());
+    });
+  }
+  void add_static_string_column(const char *v) {
+    columns_.push_back([v](CsvLine &line, Ts... x) { line.append_text(v); });
+  }
+
+  void play(Ts... x) override {
+    CsvLine line;
+    for (auto &column : columns_) column(line.next_cell(), x...);
+    if (this->static_path_ != nullptr) {
+      this->parent_->csv_append_line(this->static_path_, line);
+    } else {
+      this->parent_->csv_append_line(this->path_.value(x...).c_str(), line);
+    }
+  }
+
+ protected:
+  const char *static_path_{nullptr};
+  std::vector<std::function<void(CsvLine &, Ts...)>> columns_;
+};
+
+#ifdef USE_SD_SPI_CARD_HTTP_EXPORT
+// Serves GET <prefix>/<path> straight from the card.
+//   Range: bytes=a-b            -> 206 with that byte range
+//   ?rows=a-b[&col=i&cond=>5]   -> CSV slice, same filter syntax as csv_read_rows_range
+class SdSpiCardHttpHandler : public AsyncWebHandler {
+ public:
+  SdSpiCardHttpHandler(SdSpiCard *parent, const std::string &prefix) : parent_(parent), prefix_(prefix) {}
+  bool canHandle(AsyncWebServerRequest *request) const override;
+  void handleRequest(AsyncWebServerRequest *request) override;
+
+ protected:
+  SdSpiCard *parent_;
+  std::string prefix_;
+};
+
+// Hooks the handler into the web server. Kept apart from SdSpiCard so it can
+// set up after WiFi, like web_server does, while the card still mounts early.
+class SdSpiCardHttpExport : public Component, public Parented<SdSpiCard> {
+ public:
+  void set_web_server_base(web_server_base::WebServerBase *base) { base_ = base; }
+  void set_url_prefix(const std::string &prefix) { prefix_ = prefix; }
+  void setup() override;
+  void dump_config() override;
+  float get_setup_priority() const override { return setup_priority::WIFI - 1.0f; }
+
+ protected:
+  web_server_base::WebServerBase *base_{nullptr};
+  std::string prefix_{"/sd"};
+};
+#endif
+
 }  // namespace sd_spi_card
 }  // namespace esphome
@@ -4,7 +4,10 @@ from esphome.components import sensor
 from esphome.const import (
     CONF_TYPE,
     STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
     UNIT_BYTES,
+    UNIT_MILLISECOND,
+    ENTITY_CATEGORY_DIAGNOSTIC,
     ICON_MEMORY,
 )
 from . import (
@@ -19,9 +22,15 @@ CONF_USED_SPACE = "used_space"
 CONF_TOTAL_SPACE = "total_space"
 CONF_FREE_SPACE = "free_space"
 CONF_FILE_SIZE = "file_size"
+CONF_SPILL_QUEUED = "spill_queued"
+CONF_SPILL_REPLAYED = "spill_replayed"
+CONF_SPILL_DROPPED = "spill_dropped"
+CONF_RECOVERY_TIME = "recovery_time"
 
-TYPES = [CONF_USED_SPACE, CONF_TOTAL_SPACE, CONF_FREE_SPACE, CONF_FILE_SIZE]
-SIMPLE_TYPES = [CONF_USED_SPACE, CONF_TOTAL_SPACE, CONF_FREE_SPACE]
+TYPES = [CONF_USED_SPACE, CONF_TOTAL_SPACE, CONF_FREE_SPACE, CONF_FILE_SIZE,
+         CONF_SPILL_QUEUED, CONF_SPILL_REPLAYED, CONF_SPILL_DROPPED, CONF_RECOVERY_TIME]
+SIMPLE_TYPES = [CONF_USED_SPACE, CONF_TOTAL_SPACE, CONF_FREE_SPACE,
+                CONF_SPILL_QUEUED, CONF_SPILL_REPLAYED, CONF_SPILL_DROPPED, CONF_RECOVERY_TIME]
 
 BASE_CONFIG_SCHEMA = sensor.sensor_schema(
     unit_of_measurement=UNIT_BYTES,
@@ -34,11 +43,40 @@ BASE_CONFIG_SCHEMA = sensor.sensor_schema(
     }
 )
 
+# Row counters of the offline spill queue
+SPILL_CONFIG_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement="rows",
+    icon="mdi:tray-full",
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_TOTAL_INCREASING,
+).extend(
+    {
+        cv.GenerateID(CONF_SD_SPI_CARD_ID): cv.use_id(SdSpiCard),
+    }
+)
+
+# Duration of the last mount-time recovery pass
+RECOVERY_CONFIG_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_MILLISECOND,
+    icon="mdi:backup-restore",
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+).extend(
+    {
+        cv.GenerateID(CONF_SD_SPI_CARD_ID): cv.use_id(SdSpiCard),
+    }
+)
+
 CONFIG_SCHEMA = cv.typed_schema(
     {
         CONF_TOTAL_SPACE : BASE_CONFIG_SCHEMA,
         CONF_USED_SPACE : BASE_CONFIG_SCHEMA,
         CONF_FREE_SPACE: BASE_CONFIG_SCHEMA,
+        CONF_SPILL_QUEUED: SPILL_CONFIG_SCHEMA,
+        CONF_SPILL_REPLAYED: SPILL_CONFIG_SCHEMA,
+        CONF_SPILL_DROPPED: SPILL_CONFIG_SCHEMA,
+        CONF_RECOVERY_TIME: RECOVERY_CONFIG_SCHEMA,
         CONF_FILE_SIZE: BASE_CONFIG_SCHEMA.extend(
             {
                 cv.Required(CONF_PATH): cv.templatable(cv.string_strict),